@@ -0,0 +1,206 @@
+/**
+ * @brief Micro benchmark of the wake up path of AtomicQueue, the queue feeding audio threads.
+ *
+ * Producer thread emulates Connection pushing audio packets, it stamps every packet with the current time
+ * and pushes it with pushDiscard. Consumer thread emulates PcmAudio, it waits for the queue and pops.
+ * AtomicQueue waiting with AdaptiveWaiter is compared with the previous mutex/condition variable waiting,
+ * copied below as LegacyAtomicQueue.
+ *
+ * Reported per run: wake latency percentiles (push to pop), time producer spends in push
+ * and voluntary context switches of both threads.
+ *
+ * Usage: atomic_queue_bench [count] [interval_us]
+ *   interval_us = 0 runs as fast as possible, otherwise producer paces pushes like usb messages
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "struct/atomic_queue.h"
+
+template <typename T>
+class LegacyAtomicQueue
+{
+public:
+    LegacyAtomicQueue(uint16_t size)
+        : _size(size), _data(new unique_ptr<T>[size]), _first(0), _last(0), _count(0)
+    {
+    }
+
+    bool pushDiscard(unique_ptr<T> obj)
+    {
+        if (_count.load(std::memory_order_acquire) == _size)
+            return false;
+
+        _first = (_first + 1) % _size;
+        _data[_first] = std::move(obj);
+        _count.fetch_add(1, std::memory_order_release);
+        _lock.notify_one();
+        return true;
+    }
+
+    unique_ptr<T> pop()
+    {
+        if (_count.load(std::memory_order_acquire) == 0)
+            return nullptr;
+
+        _last = (_last + 1) % _size;
+        auto item = std::move(_data[_last]);
+        _count.fetch_sub(1, std::memory_order_release);
+        return item;
+    }
+
+    bool wait(atomic<bool> &waitFlag, uint16_t count = 0)
+    {
+        unique_lock<std::mutex> lock(_mtx);
+
+        _lock.wait(lock, [&]
+                   { return _count.load(std::memory_order_acquire) > count || !waitFlag.load(std::memory_order_acquire); });
+        return waitFlag.load(std::memory_order_acquire);
+    }
+
+    void notify()
+    {
+        _lock.notify_all();
+    }
+
+private:
+    uint16_t _size;
+    unique_ptr<unique_ptr<T>[]> _data;
+    uint16_t _first;
+    uint16_t _last;
+    atomic<uint16_t> _count;
+    mutex _mtx;
+    condition_variable _lock;
+};
+
+struct Result
+{
+    double seconds = 0;
+    long producerSwitches = 0;
+    long consumerSwitches = 0;
+    uint64_t rejected = 0;
+    std::vector<uint32_t> push;
+    std::vector<uint32_t> latency;
+};
+
+static uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long contextSwitches()
+{
+    rusage usage{};
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_nvcsw;
+}
+
+template <typename Queue>
+static Result run(uint32_t intervalUs, uint32_t count)
+{
+    Queue queue(128);
+    std::atomic<bool> active(true);
+    Result result;
+    result.latency.reserve(count);
+    result.push.reserve(count);
+
+    std::thread consumer([&]()
+                         {
+        long start = contextSwitches();
+        uint32_t received = 0;
+        while (received < count && queue.wait(active))
+        {
+            while (std::unique_ptr<uint64_t> stamp = queue.pop())
+            {
+                result.latency.push_back(static_cast<uint32_t>(nowNs() - *stamp));
+                received++;
+            }
+        }
+        result.consumerSwitches = contextSwitches() - start; });
+
+    uint64_t begin = nowNs();
+    long start = contextSwitches();
+    uint64_t next = begin;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (intervalUs > 0)
+        {
+            next += intervalUs * 1000ull;
+            uint64_t now = nowNs();
+            if (next > now)
+                std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+        }
+
+        uint64_t stamp = nowNs();
+        while (!queue.pushDiscard(std::make_unique<uint64_t>(stamp)))
+        {
+            result.rejected++;
+            std::this_thread::yield();
+            stamp = nowNs();
+        }
+        result.push.push_back(static_cast<uint32_t>(nowNs() - stamp));
+    }
+    result.producerSwitches = contextSwitches() - start;
+
+    consumer.join();
+    result.seconds = (nowNs() - begin) / 1e9;
+    active = false;
+    queue.notify();
+    return result;
+}
+
+static double percentile(std::vector<uint32_t> &values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    size_t index = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+    return values[index] / 1000.0;
+}
+
+static void report(const char *name, uint32_t count, Result &result)
+{
+    std::sort(result.latency.begin(), result.latency.end());
+    std::sort(result.push.begin(), result.push.end());
+
+    std::printf("%-8s %10.0f msg/s  wake p50 %7.2fus p90 %7.2fus p99 %7.2fus max %8.2fus  push p50 %5.2fus p99 %6.2fus  switches producer %6ld consumer %6ld\n",
+                name,
+                count / result.seconds,
+                percentile(result.latency, 0.5),
+                percentile(result.latency, 0.9),
+                percentile(result.latency, 0.99),
+                percentile(result.latency, 1.0),
+                percentile(result.push, 0.5),
+                percentile(result.push, 0.99),
+                result.producerSwitches,
+                result.consumerSwitches);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t count = argc > 1 ? std::atoi(argv[1]) : 20000;
+    uint32_t intervalUs = argc > 2 ? std::atoi(argv[2]) : 500;
+
+    std::printf("%u messages, %s\n", count, intervalUs ? "paced" : "as fast as possible");
+    if (intervalUs)
+        std::printf("producer interval %uus\n", intervalUs);
+
+    Result legacy = run<LegacyAtomicQueue<uint64_t>>(intervalUs, count);
+    report("legacy", count, legacy);
+
+    Result adaptive = run<AtomicQueue<uint64_t>>(intervalUs, count);
+    report("adaptive", count, adaptive);
+
+    return 0;
+}
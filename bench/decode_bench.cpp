@@ -0,0 +1,342 @@
+/**
+ * @brief Headless benchmark of the video path without SDL and a phone: recorded stream is pushed to
+ * VideoQueue the way Connection does, Decoder runs on its own thread and a reader thread takes
+ * frames out of VideoBuffer the way the renderer does.
+ *
+ * Input is an Annex-B H.264 file, split into frames with the FFmpeg parser, or a usb session written
+ * with usb-capture-file, video messages are taken from its inbound data. Encrypted sessions can't be decoded.
+ * Realtime mode feeds packets at capture timestamps (source-fps for Annex-B files) and reads frames at
+ * source-fps, otherwise packets go as fast as the decoder takes them and frames are read as soon as they come.
+ * Any application setting can be given as name=value, like decode-low-delay, decode-fast or hw-decode.
+ *
+ * Sweep runs the stream once in every decode-threading mode, auto picks by the width and height settings
+ * the same way the application does. Frame threads show up as added latency, slice threads only help
+ * streams with several slices.
+ *
+ * Reported per run: decoded frames per second, time from taking the packet off the queue to its frame (p50, p99),
+ * packets dropped by VideoQueue, frames dropped in VideoBuffer::write because the reader was behind
+ * and the decoder stats line, then peak RSS.
+ *
+ * Usage: decode_bench file [realtime] [sweep] [setting=value ...]
+ */
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/logger.h"
+#include "decoder.h"
+#include "protocol/capture.h"
+#include "protocol/header_scanner.h"
+#include "protocol/message.h"
+#include "protocol/video_queue.h"
+#include "settings.h"
+
+#define QUEUE_SIZE 128      // Same as the connection video queue
+#define VIDEO_HEADER 20     // Dongle video message starts with size, flags and timestamp
+#define SETTLE_TIME 300     // ms without new frames after the last packet before the run is over
+
+struct Packet
+{
+    std::vector<uint8_t> data;
+    uint64_t time; // us from the first packet
+};
+
+struct Stream
+{
+    std::vector<Packet> packets;
+    uint32_t encrypted = 0;
+};
+
+static bool loadAnnexB(const std::vector<uint8_t> &data, Stream &stream)
+{
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    AVCodecParserContext *parser = av_parser_init(AV_CODEC_ID_H264);
+    AVCodecContext *context = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!parser || !context)
+    {
+        av_parser_close(parser);
+        avcodec_free_context(&context);
+        return false;
+    }
+
+    uint64_t step = 1000000 / std::max<int>(Settings::sourceFps, 1);
+    const uint8_t *input = data.data();
+    int remain = static_cast<int>(data.size());
+    bool flushed = false;
+    // Null data at the end makes the parser give out the last frame
+    while (!flushed)
+    {
+        flushed = remain == 0;
+        uint8_t *out;
+        int size;
+        int used = av_parser_parse2(parser, context, &out, &size, remain ? input : nullptr, remain, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+        if (used < 0)
+            break;
+        input += used;
+        remain -= used;
+        if (size > 0)
+            stream.packets.push_back({std::vector<uint8_t>(out, out + size), stream.packets.size() * step});
+    }
+
+    av_parser_close(parser);
+    avcodec_free_context(&context);
+    return !stream.packets.empty();
+}
+
+static bool loadCapture(const std::vector<uint8_t> &data, Stream &stream)
+{
+    std::vector<uint8_t> pending;
+    size_t start = 0;
+    uint64_t first = 0;
+    size_t position = sizeof(CaptureHeader);
+
+    while (position + sizeof(CaptureRecord) <= data.size())
+    {
+        CaptureRecord record;
+        std::memcpy(&record, data.data() + position, sizeof(record));
+        position += sizeof(record);
+        if (position + record.length > data.size())
+            break;
+        if (record.direction == CAPTURE_INBOUND)
+            pending.insert(pending.end(), data.begin() + position, data.begin() + position + record.length);
+        position += record.length;
+
+        // Messages completed by this transfer get its timestamp, as they would reach the queue about then
+        while (pending.size() - start >= sizeof(Header))
+        {
+            int32_t offset = findHeader(pending.data() + start, pending.size() - start);
+            if (offset < 0)
+            {
+                start = pending.size();
+                break;
+            }
+            start += offset;
+            if (pending.size() - start < sizeof(Header))
+                break;
+
+            Header header;
+            std::memcpy(&header, pending.data() + start, sizeof(header));
+            if (pending.size() - start < sizeof(Header) + header.length)
+                break;
+
+            const uint8_t *payload = pending.data() + start + sizeof(Header);
+            if (header.type == CMD_VIDEO_DATA && header.magic == MAGIC_ENC)
+                stream.encrypted++;
+            else if (header.type == CMD_VIDEO_DATA && header.length > VIDEO_HEADER)
+            {
+                if (stream.packets.empty())
+                    first = record.timestamp;
+                stream.packets.push_back({std::vector<uint8_t>(payload + VIDEO_HEADER, payload + header.length), record.timestamp - first});
+            }
+            start += sizeof(Header) + header.length;
+        }
+
+        if (start > 0 && start >= pending.size() / 2)
+        {
+            pending.erase(pending.begin(), pending.begin() + start);
+            start = 0;
+        }
+    }
+
+    return !stream.packets.empty();
+}
+
+static bool load(const char *filename, Stream &stream)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+        return false;
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    CaptureHeader header;
+    if (data.size() >= sizeof(header))
+    {
+        std::memcpy(&header, data.data(), sizeof(header));
+        if (header.magic == CAPTURE_MAGIC && header.version == CAPTURE_VERSION)
+            return loadCapture(data, stream);
+    }
+    return loadAnnexB(data, stream);
+}
+
+static bool apply(const char *arg)
+{
+    const char *eq = std::strchr(arg, '=');
+    if (!eq)
+        return false;
+
+    std::string key(arg, eq - arg);
+    std::string value(eq + 1);
+    for (ISetting *setting : _settings())
+    {
+        if (setting->name == key)
+        {
+            setting->parse(value);
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::unique_ptr<Message> videoMessage(const Packet &packet)
+{
+    // Same layout processLoop gives to video messages, payload is followed by decoder padding
+    std::unique_ptr<Message> message = std::make_unique<Message>();
+    Header header{MAGIC, static_cast<int32_t>(packet.data.size()), CMD_VIDEO_DATA, ~static_cast<uint32_t>(CMD_VIDEO_DATA)};
+    std::memcpy(message->header(), &header, sizeof(header));
+    uint8_t *buffer = message->allocate(AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buffer)
+        return nullptr;
+    std::memcpy(buffer, packet.data.data(), packet.data.size());
+    return message;
+}
+
+static uint32_t run(const Stream &stream, bool realtime, const char *name)
+{
+    VideoQueue queue(QUEUE_SIZE);
+    Decoder decoder;
+    decoder.start(&queue, AV_CODEC_ID_H264);
+
+    // Renderer draws at most once per source frame in realtime mode
+    std::atomic<bool> reading(true);
+    std::thread reader([&]()
+                       {
+        std::chrono::microseconds interval(realtime ? 1000000 / std::max<int>(Settings::sourceFps, 1) : 100);
+        uint32_t latestId = 0;
+        while (reading)
+        {
+            AVFrame *frame;
+            uint32_t id;
+            if (decoder.buffer.latestId() != latestId && decoder.buffer.consume(&frame, &id))
+                latestId = id;
+            std::this_thread::sleep_for(interval);
+        } });
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (const Packet &packet : stream.packets)
+    {
+        if (realtime)
+            std::this_thread::sleep_until(begin + std::chrono::microseconds(packet.time));
+        else
+        {
+            // Decoder sets the pace, queue is kept from dropping
+            while (queue.count() >= QUEUE_SIZE / 2)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+
+        std::unique_ptr<Message> message = videoMessage(packet);
+        if (message)
+            queue.push(std::move(message));
+    }
+
+    // Last frame time is the end of the run, settle time only proves nothing else comes
+    uint32_t frames = decoder.frames();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    while (queue.count() > 0 || std::chrono::steady_clock::now() - end < std::chrono::milliseconds(SETTLE_TIME))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (decoder.frames() != frames)
+        {
+            frames = decoder.frames();
+            end = std::chrono::steady_clock::now();
+        }
+    }
+    double seconds = std::chrono::duration<double>(end - begin).count();
+
+    decoder.stop();
+    reading = false;
+    reader.join();
+
+    std::printf("%-8s frames %u  %.1f fps  latency p50 %.2fms p99 %.2fms  queue drops %u  buffer drops %u\n",
+                name,
+                frames,
+                seconds > 0 ? frames / seconds : 0.0,
+                decoder.percentile(0.5) / 1000.0,
+                decoder.percentile(0.99) / 1000.0,
+                queue.dropped(),
+                decoder.buffer.dropped());
+    std::printf("%-8s decoder %s\n", name, decoder.stats().c_str());
+    return frames;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filename = nullptr;
+    bool realtime = false;
+    bool sweep = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "realtime") == 0)
+            realtime = true;
+        else if (std::strcmp(argv[i], "sweep") == 0)
+            sweep = true;
+        else if (std::strchr(argv[i], '='))
+        {
+            if (!apply(argv[i]))
+            {
+                std::printf("Unknown setting %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+            filename = argv[i];
+    }
+
+    if (!filename)
+    {
+        std::printf("Usage: decode_bench file [realtime] [sweep] [setting=value ...]\n");
+        return 1;
+    }
+
+    set_log_level(Settings::loglevel);
+
+    Stream stream;
+    if (!load(filename, stream))
+    {
+        std::printf("%s: no video found%s\n", filename, stream.encrypted ? ", session is encrypted" : "");
+        return 1;
+    }
+
+    std::printf("%s: %zu packets, %s, decode-low-delay=%s decode-fast=%s hw-decode=%s decode-direct=%s decode-threads=%d\n",
+                filename, stream.packets.size(), realtime ? "realtime" : "as fast as possible",
+                Settings::codecLowDelay.asString().c_str(), Settings::codecFast.asString().c_str(),
+                Settings::hwDecode.asString().c_str(), Settings::videoDirect.asString().c_str(),
+                static_cast<int>(Settings::decodeThreads));
+    if (stream.encrypted)
+        std::printf("%u encrypted video messages skipped\n", stream.encrypted);
+
+    // Threading modes in the order of their decode-threading values
+    const char *names[] = {"default", "slice", "frame", "auto"};
+    int first = sweep ? DECODER_THREADING_DEFAULT : static_cast<int>(Settings::decodeThreading);
+    int last = sweep ? DECODER_THREADING_AUTO : first;
+    int failed = 0;
+    for (int mode = first; mode <= last; mode++)
+    {
+        Settings::decodeThreading = mode;
+        bool known = mode >= DECODER_THREADING_DEFAULT && mode <= DECODER_THREADING_AUTO;
+        if (run(stream, realtime, known ? names[mode] : "threads") == 0)
+            failed++;
+    }
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::printf("peak rss %.1fMB\n", usage.ru_maxrss / 1024.0);
+
+    return failed ? 1 : 0;
+}
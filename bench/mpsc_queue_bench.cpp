@@ -0,0 +1,230 @@
+/**
+ * @brief Micro benchmark and stress test of the multi producer queue used by the write lanes.
+ *
+ * Three producer threads emulate the writers of Connection::writeQueue: the main thread sending
+ * touches and keys, the microphone callback and Connection::sendInit. Every item carries producer id,
+ * sequence number and push time. Single consumer emulates Connection::writeLoop.
+ * The lock free MpscQueue is compared with the mutex/condition variable lane used before,
+ * copied below as LegacyQueue.
+ *
+ * Reported per run: items per second, push duration percentiles (time producer spends in push,
+ * what a realtime callback pays), hand over latency percentiles and pushes rejected by a full queue.
+ * Every run checks that nothing is lost or duplicated and every producer's order is kept,
+ * stress mode repeats the runs to catch rare interleavings.
+ *
+ * Usage: mpsc_queue_bench [count_per_producer] [stress]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "struct/mpsc_queue.h"
+
+#define PRODUCERS 3
+#define QUEUE_SIZE 64
+
+struct Item
+{
+    uint32_t producer;
+    uint32_t sequence;
+    uint64_t stamp;
+};
+
+class LegacyQueue
+{
+public:
+    LegacyQueue(uint16_t size)
+        : _items(new std::unique_ptr<Item>[size]), _size(size) {}
+
+    bool pushDiscard(std::unique_ptr<Item> item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (_count == _size)
+                return false;
+            _items[(_first + _count) % _size] = std::move(item);
+            _count++;
+        }
+        _cv.notify_one();
+        return true;
+    }
+
+    std::unique_ptr<Item> pop()
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_count == 0)
+            return nullptr;
+        std::unique_ptr<Item> result = std::move(_items[_first]);
+        _first = (_first + 1) % _size;
+        _count--;
+        return result;
+    }
+
+    bool waitFor(std::atomic<bool> &waitFlag, uint32_t timeoutMs)
+    {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]
+                     { return _count > 0 || !waitFlag.load(); });
+        return waitFlag.load();
+    }
+
+    void notify()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+        }
+        _cv.notify_all();
+    }
+
+private:
+    std::unique_ptr<std::unique_ptr<Item>[]> _items;
+    uint16_t _size;
+    uint16_t _first = 0;
+    uint16_t _count = 0;
+    std::mutex _mtx;
+    std::condition_variable _cv;
+};
+
+struct Result
+{
+    double seconds = 0;
+    uint64_t received = 0;
+    uint64_t rejected = 0;
+    uint64_t errors = 0;
+    std::vector<uint32_t> push;
+    std::vector<uint32_t> latency;
+};
+
+static uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename Queue>
+static Result run(uint32_t count)
+{
+    Queue queue(QUEUE_SIZE);
+    std::atomic<bool> active(true);
+    std::atomic<uint32_t> running(PRODUCERS);
+    std::vector<std::vector<uint32_t>> pushTimes(PRODUCERS);
+    std::vector<uint64_t> rejected(PRODUCERS, 0);
+    Result result;
+    result.latency.reserve(count * PRODUCERS);
+
+    uint64_t begin = nowNs();
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < PRODUCERS; p++)
+    {
+        producers.emplace_back([&, p]()
+                               {
+            pushTimes[p].reserve(count);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                std::unique_ptr<Item> item(new Item{p, i, nowNs()});
+                // Full queue is retried, so the consumer can check the sequence has no gaps
+                while (true)
+                {
+                    uint64_t start = nowNs();
+                    bool pushed = queue.pushDiscard(std::move(item));
+                    pushTimes[p].push_back(static_cast<uint32_t>(nowNs() - start));
+                    if (pushed)
+                        break;
+                    rejected[p]++;
+                    item.reset(new Item{p, i, nowNs()});
+                    std::this_thread::yield();
+                }
+            }
+            running.fetch_sub(1); });
+    }
+
+    std::vector<uint32_t> expected(PRODUCERS, 0);
+    while (true)
+    {
+        std::unique_ptr<Item> item = queue.pop();
+        if (!item)
+        {
+            if (running.load() == 0 && !(item = queue.pop()))
+                break;
+            if (!item)
+            {
+                queue.waitFor(active, 1);
+                continue;
+            }
+        }
+
+        result.latency.push_back(static_cast<uint32_t>(nowNs() - item->stamp));
+        result.received++;
+        if (item->producer >= PRODUCERS || item->sequence != expected[item->producer])
+            result.errors++;
+        else
+            expected[item->producer] = item->sequence + 1;
+    }
+    result.seconds = (nowNs() - begin) / 1e9;
+
+    for (std::thread &producer : producers)
+        producer.join();
+    for (uint32_t p = 0; p < PRODUCERS; p++)
+    {
+        result.rejected += rejected[p];
+        result.push.insert(result.push.end(), pushTimes[p].begin(), pushTimes[p].end());
+        if (expected[p] != count)
+            result.errors++;
+    }
+    return result;
+}
+
+static double percentile(std::vector<uint32_t> &values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    size_t index = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+    return values[index] / 1000.0;
+}
+
+static void report(const char *name, Result &result)
+{
+    std::sort(result.push.begin(), result.push.end());
+    std::sort(result.latency.begin(), result.latency.end());
+
+    std::printf("%-8s %10.0f items/s  push p50 %6.2fus p99 %6.2fus max %8.2fus  latency p50 %7.2fus p99 %8.2fus  rejected %llu",
+                name,
+                result.received / result.seconds,
+                percentile(result.push, 0.5),
+                percentile(result.push, 0.99),
+                percentile(result.push, 1.0),
+                percentile(result.latency, 0.5),
+                percentile(result.latency, 0.99),
+                static_cast<unsigned long long>(result.rejected));
+    std::printf("  %s\n", result.errors ? "FAILED" : "ok");
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t count = argc > 1 ? std::atoi(argv[1]) : 200000;
+    bool stress = argc > 2 && std::strcmp(argv[2], "stress") == 0;
+
+    std::printf("%d producers, %u items each, queue of %d%s\n", PRODUCERS, count, QUEUE_SIZE, stress ? ", stress" : "");
+
+    int failed = 0;
+    for (int round = 0; round < (stress ? 20 : 1); round++)
+    {
+        Result legacy = run<LegacyQueue>(count);
+        report("legacy", legacy);
+
+        Result mpsc = run<MpscQueue<Item>>(count);
+        report("mpsc", mpsc);
+        failed += legacy.errors > 0 || mpsc.errors > 0;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+/**
+ * @brief Micro benchmark of the usb reading hand over between usb-read and usb-process threads.
+ *
+ * Producer thread emulates Connection::onTransfer, takes a slot, stamps it with the current time
+ * and commits it. Consumer thread emulates Connection::processLoop and reads the stream slot by slot.
+ * The lock free UsbBuffer is compared with the previous mutex/condition variable implementation,
+ * copied below as LegacyUsbBuffer.
+ *
+ * Reported per run: slots per second, hand over latency percentiles and voluntary context switches
+ * of both threads (each one is a futex sleep).
+ *
+ * Usage: usb_buffer_bench [count] [slot_size] [interval_us]
+ *   interval_us = 0 runs as fast as possible, otherwise producer paces commits like usb transfers
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "protocol/usb_buffer.h"
+
+class LegacyDataSlot
+{
+public:
+    ~LegacyDataSlot() { free(data); }
+
+    void init(uint32_t slotSize, std::condition_variable *condition)
+    {
+        size = slotSize;
+        data = static_cast<uint8_t *>(malloc(size));
+        _cv = condition;
+    }
+
+    void commit(size_t dataSize)
+    {
+        length = dataSize;
+        offset = 0;
+        ready.store(true);
+        _cv->notify_one();
+    }
+
+    bool consume(size_t dataSize)
+    {
+        offset += dataSize;
+        if (offset < length)
+            return false;
+        ready.store(false);
+        return true;
+    }
+
+    size_t remain() const { return length > offset ? length - offset : 0; }
+
+    std::atomic<bool> ready{false};
+    size_t offset = 0;
+    size_t length = 0;
+    size_t size = 0;
+    uint8_t *data = nullptr;
+
+private:
+    std::condition_variable *_cv = nullptr;
+};
+
+class LegacyUsbBuffer
+{
+public:
+    LegacyUsbBuffer(uint16_t slotCount, uint32_t slotSize)
+        : _slots(new LegacyDataSlot[slotCount]), _size(slotCount)
+    {
+        for (uint16_t i = 0; i < _size; i++)
+            _slots[i].init(slotSize, &_cv);
+    }
+
+    ~LegacyUsbBuffer() { delete[] _slots; }
+
+    LegacyDataSlot *get()
+    {
+        if (_slots[_writeSlot].ready.load())
+            return nullptr;
+        LegacyDataSlot *slot = &(_slots[_writeSlot]);
+        _writeSlot++;
+        if (_writeSlot >= _size)
+            _writeSlot = 0;
+        return slot;
+    }
+
+    bool read(uint8_t *dst, uint32_t length, std::atomic<bool> &active)
+    {
+        size_t done = 0;
+        while (length > 0)
+        {
+            while (!_slots[_readSlot].ready.load())
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait(lock, [&]()
+                         { return !active.load() || _slots[_readSlot].ready.load(); });
+                if (!active.load())
+                    return false;
+            }
+
+            size_t copy = std::min<size_t>(_slots[_readSlot].remain(), length);
+            std::memcpy(dst + done, _slots[_readSlot].data + _slots[_readSlot].offset, copy);
+            if (_slots[_readSlot].consume(copy))
+            {
+                _readSlot++;
+                if (_readSlot >= _size)
+                    _readSlot = 0;
+            }
+            done += copy;
+            length -= copy;
+        }
+        return active.load();
+    }
+
+    void notify() { _cv.notify_all(); }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    LegacyDataSlot *_slots;
+    uint16_t _size;
+    uint16_t _writeSlot = 0;
+    uint16_t _readSlot = 0;
+};
+
+struct Result
+{
+    double seconds = 0;
+    long producerSwitches = 0;
+    long consumerSwitches = 0;
+    uint64_t exhausted = 0;
+    std::vector<uint32_t> latency;
+};
+
+static uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long contextSwitches()
+{
+    rusage usage{};
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_nvcsw;
+}
+
+template <typename Buffer>
+static Result run(uint32_t slots, uint32_t slotSize, uint32_t intervalUs, uint32_t count)
+{
+    Buffer buffer(slots, slotSize);
+    std::atomic<bool> active(true);
+    Result result;
+    result.latency.reserve(count);
+
+    std::thread consumer([&]()
+                         {
+        std::vector<uint8_t> data(slotSize);
+        long start = contextSwitches();
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!buffer.read(data.data(), slotSize, active))
+                break;
+            uint64_t stamp;
+            std::memcpy(&stamp, data.data(), sizeof(stamp));
+            result.latency.push_back(static_cast<uint32_t>(nowNs() - stamp));
+        }
+        result.consumerSwitches = contextSwitches() - start; });
+
+    uint64_t begin = nowNs();
+    long start = contextSwitches();
+    uint64_t next = begin;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (intervalUs > 0)
+        {
+            next += intervalUs * 1000ull;
+            while (nowNs() < next)
+                std::this_thread::yield();
+        }
+
+        auto slot = buffer.get();
+        while (!slot)
+        {
+            result.exhausted++;
+            std::this_thread::yield();
+            slot = buffer.get();
+        }
+        uint64_t stamp = nowNs();
+        std::memcpy(slot->data, &stamp, sizeof(stamp));
+        slot->commit(slotSize);
+    }
+    result.producerSwitches = contextSwitches() - start;
+
+    consumer.join();
+    result.seconds = (nowNs() - begin) / 1e9;
+    active = false;
+    buffer.notify();
+    return result;
+}
+
+static void report(const char *name, uint32_t count, Result &result)
+{
+    std::sort(result.latency.begin(), result.latency.end());
+    auto percentile = [&](double p)
+    {
+        if (result.latency.empty())
+            return 0.0;
+        size_t index = std::min(result.latency.size() - 1, static_cast<size_t>(p * result.latency.size()));
+        return result.latency[index] / 1000.0;
+    };
+
+    std::printf("%-8s %10.0f slots/s  latency p50 %7.2fus p99 %7.2fus max %8.2fus  switches producer %6ld consumer %6ld  exhausted %llu\n",
+                name,
+                count / result.seconds,
+                percentile(0.5),
+                percentile(0.99),
+                percentile(1.0),
+                result.producerSwitches,
+                result.consumerSwitches,
+                static_cast<unsigned long long>(result.exhausted));
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t count = argc > 1 ? std::atoi(argv[1]) : 200000;
+    uint32_t slotSize = argc > 2 ? std::atoi(argv[2]) : 2048;
+    uint32_t intervalUs = argc > 3 ? std::atoi(argv[3]) : 0;
+
+    std::printf("%u slots of %u bytes, %s\n", count, slotSize, intervalUs ? "paced" : "as fast as possible");
+    if (intervalUs)
+        std::printf("producer interval %uus (~%.1f MB/s)\n", intervalUs, slotSize / (intervalUs * 1.0));
+
+    Result legacy = run<LegacyUsbBuffer>(128, slotSize, intervalUs, count);
+    report("legacy", count, legacy);
+
+    Result ring = run<UsbBuffer>(128, slotSize, intervalUs, count);
+    report("ring", count, ring);
+
+    return 0;
+}
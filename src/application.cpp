@@ -6,6 +6,8 @@
 #include <chrono>
 #include <thread>
 
+#include "common/timer_wheel.h"
+#include "struct/buffer_pool.h"
 #include "struct/video_buffer.h"
 #include "common/logger.h"
 
@@ -39,14 +41,16 @@ static KeySetting<int> *keyMap[] = {
     &Settings::keyVideoFocus,
     &Settings::keyVideoRelease,
     &Settings::keyNavFocus,
-    &Settings::keyNavRelease};
+    &Settings::keyNavRelease,
+    &Settings::keyNextSession};
 
 static constexpr size_t keyMapSize = sizeof(keyMap) / sizeof(keyMap[0]);
 
 Application::Application(/* args */) : _window(nullptr),
                                        _renderer(nullptr),
                                        _keyListener(nullptr),
-                                       _active(true)
+                                       _active(true),
+                                       _refresh{0, 0}
 {
     log_v("Creating");
 
@@ -155,19 +159,26 @@ bool Application::setAudioDriver()
     return false;
 }
 
-int Application::processKey(SDL_Keysym key)
+int Application::mapKey(SDL_Keycode sym)
 {
     for (uint8_t i = 0; i < keyMapSize; i++)
     {
-        if (keyMap[i]->value == key.sym)
+        if (keyMap[i]->value == sym)
         {
             return keyMap[i]->key;
         }
     }
-    log_w("Unmapped key %d", key.sym);
     return 0;
 }
 
+int Application::processKey(SDL_Keysym key)
+{
+    int code = mapKey(key.sym);
+    if (code == 0)
+        log_w("Unmapped key %d", key.sym);
+    return code;
+}
+
 bool Application::processSystemEvent(const SDL_Event &e)
 {
     if (e.type == SDL_QUIT)
@@ -214,8 +225,14 @@ bool Application::processSystemEvent(const SDL_Event &e)
         case SDLK_r:
         {
             _state.dirty = true;
-            _state.requestFrame = 1;
+            _state.requestFrame = true;
+        }
         }
+        // Works on home screen too, keyboard and pipe keys come the same way
+        if (mapKey(e.key.keysym.sym) == KEY_NEXT_SESSION)
+        {
+            _state.nextSession = true;
+            return true;
         }
         bool script = false;
         std::string name = "";
@@ -263,7 +280,7 @@ bool Application::processSystemEvent(const SDL_Event &e)
     return false;
 }
 
-bool Application::processFrameEvents(AtomicQueue<Message> &queue, Renderer &renderer)
+bool Application::processFrameEvents(WriteQueue &queue, Renderer &renderer)
 {
     bool result = false;
     SDL_Event e;
@@ -313,7 +330,7 @@ bool Application::processFrameEvents(AtomicQueue<Message> &queue, Renderer &rend
             int key = processKey(e.key.keysym);
             if (key > 0)
             {
-                queue.pushDiscard(Message::Control(key));
+                queue.push(Message::Control(key));
                 result = true;
             }
             break;
@@ -322,7 +339,7 @@ bool Application::processFrameEvents(AtomicQueue<Message> &queue, Renderer &rend
         {
             if (e.key.keysym.sym == Settings::keyEnter)
             {
-                queue.pushDiscard(Message::Control(Settings::keyEnterUp.key));
+                queue.push(Message::Control(Settings::keyEnterUp.key));
                 result = true;
             }
             break;
@@ -333,11 +350,11 @@ bool Application::processFrameEvents(AtomicQueue<Message> &queue, Renderer &rend
     if (_state.frameRendered && (downX >= 0 || upX >= 0 || motion))
     {
         if (downX >= 0)
-            queue.pushDiscard(Message::Click(renderer.xScale * downX / _width, renderer.yScale * downY / _height, true));
+            queue.push(Message::Click(renderer.xScale * downX / _width, renderer.yScale * downY / _height, true));
         if (motion)
-            queue.pushDiscard(Message::Move(renderer.xScale * motionX / _width, renderer.yScale * motionY / _height));
+            queue.push(Message::Move(renderer.xScale * motionX / _width, renderer.yScale * motionY / _height));
         if (upX >= 0)
-            queue.pushDiscard(Message::Click(renderer.xScale * upX / _width, renderer.yScale * upY / _height, false));
+            queue.push(Message::Click(renderer.xScale * upX / _width, renderer.yScale * upY / _height, false));
     }
 
     return result;
@@ -362,17 +379,26 @@ void Application::loop()
         SDL_ShowWindow(_window);
     interface.drawHome(true, PROTOCOL_STATUS_UNKNOWN, "");
 
-    Connection protocol;
-    Decoder decoder;
+    // Sessions are declared after the microphone so they are gone before it closes
+    Recorder recorder;
+    std::vector<std::unique_ptr<Session>> sessions;
+    for (const std::string &device : sessionDevices())
+        sessions.push_back(std::make_unique<Session>(recorder, device));
+    size_t current = 0;
+    recorder.select(&sessions[current]->protocol.writeQueue);
     PcmAudio audioMain("main"), audioAux("aux");
 
     if (Settings::keyPipe.value.length() > 2)
         _keyListener = new PipeListener(Settings::keyPipe.value.c_str());
 
-    decoder.start(&protocol.videoStream, AV_CODEC_ID_H264);
-    audioMain.start(&protocol.audioStreamMain);
-    audioAux.start(&protocol.audioStreamAux, &audioMain);
-    protocol.start();
+    for (std::unique_ptr<Session> &session : sessions)
+        session->decoder.start(&session->protocol.videoStream, AV_CODEC_ID_H264);
+    audioMain.start(&sessions[current]->protocol.audioStreamMain);
+    audioAux.start(&sessions[current]->protocol.audioStreamAux, &audioMain);
+    for (std::unique_ptr<Session> &session : sessions)
+        session->protocol.start();
+    if (sessions.size() > 1)
+        log_i("Started %zu sessions", sessions.size());
 
     log_v("Loop");
     std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
@@ -392,6 +418,56 @@ void Application::loop()
     {
         bool newFrame = false;
 
+        if (_state.nextSession)
+        {
+            _state.nextSession = false;
+            if (sessions.size() > 1)
+            {
+                current = (current + 1) % sessions.size();
+                audioMain.start(&sessions[current]->protocol.audioStreamMain);
+                audioAux.start(&sessions[current]->protocol.audioStreamAux, &audioMain);
+                recorder.select(&sessions[current]->protocol.writeQueue);
+
+                _state.latestState = sessions[current]->latestState;
+                _state.frameRendered = false;
+                _state.dirty = true;
+                _state.requestFrame = true;
+                frameId = 0;
+                _state.toast = "Session " + std::to_string(current + 1) + " " + sessions[current]->protocol.device();
+                _state.showToast = 1;
+                log_i("Showing session %zu %s", current + 1, sessions[current]->protocol.device().c_str());
+            }
+        }
+
+        for (size_t i = 0; i < sessions.size(); i++)
+        {
+            Session &session = *sessions[i];
+            // On connect
+            if (session.protocol.state() != session.latestState && session.protocol.state() == PROTOCOL_STATUS_CONNECTED)
+            {
+                session.decoder.flush();
+                session.decoder.buffer.reset();
+            }
+            session.latestState = session.protocol.state();
+
+            // Sessions in background keep decoding, their frames and audio are only released
+            if (i != current)
+            {
+                AVFrame *skipped = nullptr;
+                uint32_t skippedId = 0;
+                session.decoder.buffer.consume(&skipped, &skippedId);
+                while (session.protocol.audioStreamMain.pop())
+                {
+                }
+                while (session.protocol.audioStreamAux.pop())
+                {
+                }
+            }
+        }
+
+        Connection &protocol = sessions[current]->protocol;
+        Decoder &decoder = sessions[current]->decoder;
+
         if (_state.showToast > 0)
         {
             if (_state.showToast == 1)
@@ -416,13 +492,8 @@ void Application::loop()
             {
                 _state.frameRendered = false;
                 _state.dirty = true;
-                _state.requestFrame = 0;
-            }
-            // On connect
-            if (protocol.state() == PROTOCOL_STATUS_CONNECTED)
-            {
-                decoder.flush();
-                decoder.buffer.reset();
+                _state.requestFrame = false;
+                cancelRefresh();
             }
             _state.latestState = protocol.state();
         }
@@ -449,12 +520,10 @@ void Application::loop()
                 }
             }
 
-            if (_state.requestFrame > 0 && Settings::forceRedraw > 0 && _state.requestFrame++ % Settings::forceRedraw == 0)
+            if (_state.requestFrame)
             {
-                log_d("Request screen update");
-                protocol.send(Message::Control(BTN_SCREEN_REFRESH));
-                if (_state.requestFrame > Settings::forceRedraw * 2)
-                    _state.requestFrame = 0;
+                _state.requestFrame = false;
+                requestRefresh(protocol);
             }
         }
 
@@ -472,7 +541,7 @@ void Application::loop()
             {
                 if (processFrameEvents(protocol.writeQueue, interface) && Settings::forceRedraw > 0)
                 {
-                    _state.requestFrame = 1;
+                    _state.requestFrame = true;
                 }
                 skipEvents = 0;
             }
@@ -487,12 +556,14 @@ void Application::loop()
                 debugLastCount = protocol.transfered();
                 debugLast = SDL_GetTicks();
             }
-            char debugBuffer[2048];
+            char debugBuffer[4096];
             std::snprintf(debugBuffer, sizeof(debugBuffer),
                           "%s\n"
                           "FRAME: %u / %u [%d] dropped: %d render: %dus / %dus\n"
+                          "DECODE: %s\n"
                           "USB: %s ~%dKB/s\n"
-                          "BUFF: video [%u] audio[main %u aux %u] out [%u]",
+                          "BUFF: video [%u] audio[main %u aux %u] out [%u]\n"
+                          "POOL: hit %llu miss %llu%s",
                           status().c_str(),
                           frameId,
                           decoder.buffer.latestId(),
@@ -500,12 +571,16 @@ void Application::loop()
                           dropframes,
                           frameTime,
                           frameDelay,
+                          decoder.stats().c_str(),
                           protocol.status().c_str(),
                           debugSpeed,
                           protocol.videoStream.count(),
                           protocol.audioStreamMain.count(),
                           protocol.audioStreamAux.count(),
-                          protocol.writeQueue.count());
+                          protocol.writeQueue.count(),
+                          static_cast<unsigned long long>(BufferPool::instance().hits()),
+                          static_cast<unsigned long long>(BufferPool::instance().misses()),
+                          sessions.size() > 1 ? sessionStatus(sessions, current).c_str() : "");
             interface.debug(debugBuffer);
         }
 #endif
@@ -524,8 +599,78 @@ void Application::loop()
         }
     }
 
+    cancelRefresh();
     if (!Settings::isHeadless())
         SDL_HideWindow(_window);
+
+    if (sessions.size() > 1)
+        log_i("Sessions at exit%s", sessionStatus(sessions, current).c_str());
+}
+
+void Application::requestRefresh(Connection &protocol)
+{
+    if (Settings::forceRedraw <= 0)
+        return;
+
+    // Two requests, force-redraw and twice force-redraw frames after the input
+    cancelRefresh();
+    uint32_t delay = Settings::forceRedraw * 1000 / std::max(1, Settings::sourceFps.value);
+    auto refresh = [&protocol]()
+    {
+        if (protocol.state() != PROTOCOL_STATUS_CONNECTED)
+            return;
+        log_d("Request screen update");
+        protocol.send(Message::Control(BTN_SCREEN_REFRESH));
+    };
+    for (uint8_t i = 0; i < REFRESH_REQUESTS; i++)
+        _refresh[i] = TimerWheel::instance().once(delay * (i + 1), refresh);
+}
+
+void Application::cancelRefresh()
+{
+    for (TimerWheel::Id &id : _refresh)
+    {
+        if (id != 0)
+            TimerWheel::instance().cancel(id);
+        id = 0;
+    }
+}
+
+std::vector<std::string> Application::sessionDevices()
+{
+    std::vector<std::string> result;
+    std::istringstream in(Settings::usbDevices.value);
+    std::string device;
+    while (std::getline(in, device, ','))
+    {
+        device.erase(0, device.find_first_not_of(" \t"));
+        device.erase(device.find_last_not_of(" \t") + 1);
+        if (!device.empty())
+            result.push_back(device);
+    }
+
+    // Single session takes the first dongle found
+    if (result.empty())
+        result.push_back("");
+    return result;
+}
+
+const std::string Application::sessionStatus(const std::vector<std::unique_ptr<Session>> &sessions, size_t current)
+{
+    std::ostringstream out;
+    for (size_t i = 0; i < sessions.size(); i++)
+    {
+        const Connection &protocol = sessions[i]->protocol;
+        out << "\n"
+            << (i == current ? "[" : " ") << i + 1 << (i == current ? "]" : " ") << " "
+            << protocol.device() << " state " << static_cast<int>(protocol.state())
+            << " frames " << sessions[i]->decoder.buffer.latestId()
+            << " messages " << protocol.stats(CMD_VIDEO_DATA).messages.load(std::memory_order_relaxed)
+            << " drop " << protocol.stats(CMD_VIDEO_DATA).drops.load(std::memory_order_relaxed)
+            << " / " << protocol.stats(CMD_AUDIO_DATA).drops.load(std::memory_order_relaxed)
+            << " " << protocol.phoneName();
+    }
+    return out.str();
 }
 
 const std::string Application::status() const
@@ -3,13 +3,20 @@
 
 #include <SDL2/SDL.h>
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "protocol/protocol_const.h"
 
+#include "common/timer_wheel.h"
 #include "protocol/connection.h"
+#include "decoder.h"
 #include "pipe_listener.h"
 #include "renderer.h"
 
 #define TOAST_TIME 3
+#define REFRESH_REQUESTS 2
 
 class Application
 {
@@ -24,19 +31,35 @@ private:
     {
         bool dirty = false;
         bool frameRendered = false;
-        int requestFrame = 0;
+        bool requestFrame = false;
         bool fullscreen = false;
         bool mouseDown = false;
         int8_t latestState = PROTOCOL_STATUS_UNKNOWN;
         uint32_t showToast = false;
         std::string toast = "";
+        bool nextSession = false;
+    };
+
+    // One dongle with its own protocol and decoder, audio is played for the selected session only
+    struct Session
+    {
+        Session(Recorder &recorder, const std::string &device) : protocol(recorder, device) {}
+
+        Connection protocol;
+        Decoder decoder;
+        int8_t latestState = PROTOCOL_STATUS_UNKNOWN;
     };
 
     bool setAudioDriver();
     int processKey(SDL_Keysym key);
+    static int mapKey(SDL_Keycode sym);
     bool processSystemEvent(const SDL_Event &e);
-    bool processFrameEvents(AtomicQueue<Message> &queue, Renderer &renderer);
+    bool processFrameEvents(WriteQueue &queue, Renderer &renderer);
     const std::string status() const;
+    void requestRefresh(Connection &protocol);
+    void cancelRefresh();
+    static std::vector<std::string> sessionDevices();
+    static const std::string sessionStatus(const std::vector<std::unique_ptr<Session>> &sessions, size_t current);
 
     void loop();
 
@@ -49,6 +72,7 @@ private:
     int _width;
     int _height;
     bool _debug;
+    TimerWheel::Id _refresh[REFRESH_REQUESTS];
 };
 
 #endif /* SRC_APPLICATION */
@@ -0,0 +1,143 @@
+#ifndef SRC_COMMON_ADAPTIVE_WAITER
+#define SRC_COMMON_ADAPTIVE_WAITER
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#if defined(__linux__)
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+#define ADAPTIVE_WAITER_SPIN 256
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Spin briefly and then park the thread until notified.
+// Waiters register themselves before parking, so notify() costs no syscall while nobody sleeps.
+class AdaptiveWaiter
+{
+public:
+    AdaptiveWaiter() : _epoch(0), _waiters(0) {}
+
+    AdaptiveWaiter(const AdaptiveWaiter &) = delete;
+    AdaptiveWaiter &operator=(const AdaptiveWaiter &) = delete;
+
+    // Wait until ready() returns true, active is cleared or timeout (negative is infinite) expires.
+    // Returns active flag state same as queue waits.
+    template <typename Ready>
+    bool wait(Ready ready, std::atomic<bool> &active, int32_t timeoutMs = -1)
+    {
+        for (int i = 0; i < spinLimit(); i++)
+        {
+            if (!active.load(std::memory_order_acquire) || ready())
+                return active.load(std::memory_order_acquire);
+            cpuRelax();
+        }
+
+        const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+        while (true)
+        {
+            _waiters.fetch_add(1, std::memory_order_seq_cst);
+            uint32_t epoch = _epoch.load(std::memory_order_seq_cst);
+            if (!active.load(std::memory_order_seq_cst) || ready())
+            {
+                _waiters.fetch_sub(1, std::memory_order_relaxed);
+                break;
+            }
+
+            int64_t remainUs = -1;
+            if (timeoutMs >= 0)
+            {
+                remainUs = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count();
+                if (remainUs <= 0)
+                {
+                    _waiters.fetch_sub(1, std::memory_order_relaxed);
+                    break;
+                }
+            }
+
+            park(epoch, remainUs);
+            _waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        return active.load(std::memory_order_acquire);
+    }
+
+    // Call after publishing the data the waiter is checking for
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        _epoch.fetch_add(1, std::memory_order_release);
+        wake();
+    }
+
+    bool sleeping() const { return _waiters.load(std::memory_order_relaxed) > 0; }
+
+private:
+    // Spinning on a single core only delays the thread we are waiting for
+    static int spinLimit()
+    {
+        static const int limit = std::thread::hardware_concurrency() > 1 ? ADAPTIVE_WAITER_SPIN : 0;
+        return limit;
+    }
+
+#if defined(__linux__)
+    void park(uint32_t epoch, int64_t timeoutUs)
+    {
+        timespec timeout{static_cast<time_t>(timeoutUs / 1000000), static_cast<long>((timeoutUs % 1000000) * 1000)};
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_epoch), FUTEX_WAIT_PRIVATE, epoch, timeoutUs < 0 ? nullptr : &timeout, nullptr, 0);
+    }
+
+    void wake()
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_epoch), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+#else
+    void park(uint32_t epoch, int64_t timeoutUs)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto changed = [&]()
+        { return _epoch.load(std::memory_order_acquire) != epoch; };
+        if (timeoutUs < 0)
+            _cv.wait(lock, changed);
+        else
+            _cv.wait_for(lock, std::chrono::microseconds(timeoutUs), changed);
+    }
+
+    void wake()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+        }
+        _cv.notify_all();
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+#endif
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex word must be plain 32 bit");
+
+    std::atomic<uint32_t> _epoch;
+    std::atomic<uint32_t> _waiters;
+};
+
+#endif /* SRC_COMMON_ADAPTIVE_WAITER */
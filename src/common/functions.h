@@ -83,55 +83,4 @@ inline std::string ascii(uint8_t *data, uint32_t length)
     return oss.str();
 }
 
-inline bool jsonFindString(const uint8_t *data, int size, const char *key, char *result, int len)
-{
-    const char *p = reinterpret_cast<const char *>(data);
-    const char *end = p + size;
-
-    int keyLen = strlen(key);
-
-    while (p < end)
-    {
-        while (p < end && *p != '"')
-            ++p;
-        if (p >= end)
-            break;
-        ++p;
-
-        if ((end - p) > keyLen &&
-            strncmp(p, key, keyLen) == 0 &&
-            p[keyLen] == '"')
-        {
-            p += keyLen + 1; 
-            while (p < end && isspace((unsigned char)*p))
-                ++p;
-            if (p >= end || *p != ':')
-                continue;
-            ++p; 
-            while (p < end && isspace((unsigned char)*p))
-                ++p;
-            if (p >= end || *p != '"')
-                continue;
-            ++p;
-
-            int i = 0;
-            while (p < end && *p != '"' && i + 1 < len)
-                result[i++] = *p++;
-            result[i] = '\0';
-            return p < end && *p == '"'; 
-        }
-
-        while (p < end && *p != '"')
-        {
-            if (*p == '\\')
-                ++p; 
-            ++p;
-        }
-        if (p < end)
-            ++p;
-    }
-
-    return false;
-}
-
 #endif /* SRC_COMMON_FUNCTIONS */
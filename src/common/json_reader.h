@@ -0,0 +1,280 @@
+#ifndef SRC_COMMON_JSON_READER
+#define SRC_COMMON_JSON_READER
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+enum class JsonType : uint8_t
+{
+    String,
+    Number,
+    Bool,
+    Null,
+    Object,
+    Array
+};
+
+// One member of an object, key and value point into the parsed data.
+// String value is raw, without quotes and with escapes as they are.
+struct JsonField
+{
+    const char *key = nullptr;
+    uint32_t keyLength = 0;
+    JsonType type = JsonType::Null;
+    const char *value = nullptr;
+    uint32_t valueLength = 0;
+
+    bool is(const char *name) const
+    {
+        return std::strlen(name) == keyLength && std::memcmp(key, name, keyLength) == 0;
+    }
+
+    int64_t toInt() const
+    {
+        if (type != JsonType::Number && type != JsonType::String)
+            return 0;
+        char buffer[24];
+        uint32_t length = valueLength < sizeof(buffer) - 1 ? valueLength : sizeof(buffer) - 1;
+        std::memcpy(buffer, value, length);
+        buffer[length] = '\0';
+        return std::strtoll(buffer, nullptr, 10);
+    }
+
+    bool toBool() const { return type == JsonType::Bool ? value[0] == 't' : toInt() != 0; }
+
+    // Unescaped, null terminated copy of a string value, truncated to the size
+    bool copy(char *dst, uint32_t size) const
+    {
+        if (size == 0 || type != JsonType::String)
+            return false;
+
+        uint32_t out = 0;
+        for (uint32_t i = 0; i < valueLength && out + 1 < size; i++)
+        {
+            char ch = value[i];
+            if (ch != '\\' || i + 1 >= valueLength)
+            {
+                dst[out++] = ch;
+                continue;
+            }
+
+            ch = value[++i];
+            switch (ch)
+            {
+            case 'n':
+                dst[out++] = '\n';
+                break;
+            case 't':
+                dst[out++] = '\t';
+                break;
+            case 'r':
+            case 'b':
+            case 'f':
+                break;
+            case 'u':
+                if (i + 4 < valueLength)
+                {
+                    out += utf8(hex(value + i + 1), dst + out, size - out - 1);
+                    i += 4;
+                }
+                break;
+            default:
+                dst[out++] = ch;
+            }
+        }
+        dst[out] = '\0';
+        return true;
+    }
+
+private:
+    static uint32_t hex(const char *p)
+    {
+        uint32_t result = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char ch = p[i];
+            result <<= 4;
+            if (ch >= '0' && ch <= '9')
+                result |= ch - '0';
+            else if (ch >= 'a' && ch <= 'f')
+                result |= ch - 'a' + 10;
+            else if (ch >= 'A' && ch <= 'F')
+                result |= ch - 'A' + 10;
+        }
+        return result;
+    }
+
+    // Surrogate pairs are not joined, they are rare in names and titles
+    static uint32_t utf8(uint32_t code, char *dst, uint32_t room)
+    {
+        if (code < 0x80 && room >= 1)
+        {
+            dst[0] = static_cast<char>(code);
+            return 1;
+        }
+        if (code < 0x800 && room >= 2)
+        {
+            dst[0] = static_cast<char>(0xc0 | (code >> 6));
+            dst[1] = static_cast<char>(0x80 | (code & 0x3f));
+            return 2;
+        }
+        if (code >= 0x800 && room >= 3)
+        {
+            dst[0] = static_cast<char>(0xe0 | (code >> 12));
+            dst[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            dst[2] = static_cast<char>(0x80 | (code & 0x3f));
+            return 3;
+        }
+        return 0;
+    }
+};
+
+// Walks members of a JSON object in one pass without allocating.
+// Nested objects and arrays are returned as a single value and can be read with another reader.
+class JsonReader
+{
+public:
+    JsonReader(const uint8_t *data, int32_t size)
+        : _p(reinterpret_cast<const char *>(data)),
+          _end(reinterpret_cast<const char *>(data) + (data && size > 0 ? size : 0)),
+          _started(false),
+          _valid(true)
+    {
+    }
+
+    JsonReader(const JsonField &field)
+        : JsonReader(reinterpret_cast<const uint8_t *>(field.value), field.type == JsonType::Object ? field.valueLength : 0)
+    {
+    }
+
+    bool next(JsonField &field)
+    {
+        if (!_started)
+        {
+            _started = true;
+            skipSpace();
+            if (_p >= _end || *_p != '{')
+                return fail();
+            _p++;
+        }
+
+        skipSpace();
+        if (_p < _end && *_p == ',')
+        {
+            _p++;
+            skipSpace();
+        }
+        if (_p >= _end)
+            return fail();
+        if (*_p == '}')
+        {
+            _p = _end;
+            return false;
+        }
+
+        if (*_p != '"')
+            return fail();
+        field.key = ++_p;
+        if (!skipString())
+            return fail();
+        field.keyLength = _p - field.key - 1;
+
+        skipSpace();
+        if (_p >= _end || *_p != ':')
+            return fail();
+        _p++;
+        skipSpace();
+        if (_p >= _end)
+            return fail();
+
+        return value(field) || fail();
+    }
+
+    // False when data ended before the object or it is not an object
+    bool valid() const { return _valid; }
+
+private:
+    bool value(JsonField &field)
+    {
+        char ch = *_p;
+        if (ch == '"')
+        {
+            field.type = JsonType::String;
+            field.value = ++_p;
+            if (!skipString())
+                return false;
+            field.valueLength = _p - field.value - 1;
+            return true;
+        }
+
+        field.value = _p;
+        if (ch == '{' || ch == '[')
+        {
+            field.type = ch == '{' ? JsonType::Object : JsonType::Array;
+            if (!skipNested())
+                return false;
+        }
+        else
+        {
+            field.type = ch == 't' || ch == 'f' ? JsonType::Bool : (ch == 'n' ? JsonType::Null : JsonType::Number);
+            while (_p < _end && *_p != ',' && *_p != '}' && *_p != ' ' && *_p != '\t' && *_p != '\r' && *_p != '\n')
+                _p++;
+        }
+        field.valueLength = _p - field.value;
+        return field.valueLength > 0;
+    }
+
+    // Moves past the closing quote
+    bool skipString()
+    {
+        while (_p < _end)
+        {
+            char ch = *_p++;
+            if (ch == '\\')
+                _p++;
+            else if (ch == '"')
+                return true;
+        }
+        return false;
+    }
+
+    bool skipNested()
+    {
+        int depth = 0;
+        while (_p < _end)
+        {
+            char ch = *_p++;
+            if (ch == '"')
+            {
+                if (!skipString())
+                    return false;
+            }
+            else if (ch == '{' || ch == '[')
+                depth++;
+            else if ((ch == '}' || ch == ']') && --depth == 0)
+                return true;
+        }
+        return false;
+    }
+
+    void skipSpace()
+    {
+        while (_p < _end && (*_p == ' ' || *_p == '\t' || *_p == '\r' || *_p == '\n'))
+            _p++;
+    }
+
+    bool fail()
+    {
+        _p = _end;
+        _valid = false;
+        return false;
+    }
+
+    const char *_p;
+    const char *_end;
+    bool _started;
+    bool _valid;
+};
+
+#endif /* SRC_COMMON_JSON_READER */
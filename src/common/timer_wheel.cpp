@@ -0,0 +1,157 @@
+#include "common/timer_wheel.h"
+
+#include <algorithm>
+
+#include "common/logger.h"
+#include "common/threading.h"
+
+TimerWheel::TimerWheel()
+    : _start(std::chrono::steady_clock::now()),
+      _active(true),
+      _nextId(0),
+      _processed(0),
+      _sleepUntil(UINT64_MAX),
+      _running(0)
+{
+    _thread = std::thread(&TimerWheel::loop, this);
+    _runner = _thread.get_id();
+}
+
+TimerWheel::~TimerWheel()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _active = false;
+    }
+    _cv.notify_one();
+    if (_thread.joinable())
+        _thread.join();
+}
+
+uint64_t TimerWheel::now() const
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _start).count() / TIMER_WHEEL_TICK;
+}
+
+TimerWheel::Id TimerWheel::add(uint32_t delayMs, uint32_t periodMs, Callback callback)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    do
+    {
+        _nextId++;
+    } while (_nextId == 0 || _timers.count(_nextId) > 0);
+
+    uint64_t due = now() + std::max<uint64_t>(1, ticks(delayMs));
+    _timers.emplace(_nextId, Timer{due, periodMs > 0 ? static_cast<uint32_t>(std::max<uint64_t>(1, ticks(periodMs))) : 0, std::move(callback)});
+    schedule(_nextId, due);
+
+    // Wake the thread only when it sleeps past the new timer
+    if (due < _sleepUntil)
+    {
+        _sleepUntil = due;
+        _cv.notify_one();
+    }
+    return _nextId;
+}
+
+bool TimerWheel::cancel(Id id)
+{
+    // No timer, nothing to wait for. Running callback of another timer is not our business either
+    if (id == 0)
+        return false;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    // Slot entry is dropped when the wheel gets to it
+    bool result = _timers.erase(id) > 0;
+
+    // Callback may be running right now, wait for it unless it is the one cancelling
+    if (std::this_thread::get_id() != _runner)
+        _done.wait(lock, [&]()
+                   { return _running != id; });
+    return result;
+}
+
+size_t TimerWheel::count() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _timers.size();
+}
+
+// Next tick with a filled slot, found from the wheel alone. A slot holding only timers
+// of a later turn or cancelled ones costs one early wake, after which it is skipped for a turn.
+uint64_t TimerWheel::nearest() const
+{
+    for (uint64_t tick = _processed + 1; tick <= _processed + TIMER_WHEEL_SLOTS; tick++)
+    {
+        if (!_slots[tick % TIMER_WHEEL_SLOTS].empty())
+            return tick;
+    }
+    return UINT64_MAX;
+}
+
+void TimerWheel::process(uint64_t tick, uint64_t current, std::unique_lock<std::mutex> &lock)
+{
+    std::vector<Id> &slot = _slots[tick % TIMER_WHEEL_SLOTS];
+    size_t i = 0;
+    while (i < slot.size())
+    {
+        auto timer = _timers.find(slot[i]);
+        // Timers of a later turn stay in the slot
+        if (timer != _timers.end() && timer->second.due > current)
+        {
+            i++;
+            continue;
+        }
+
+        Id id = slot[i];
+        slot[i] = slot.back();
+        slot.pop_back();
+        if (timer == _timers.end())
+            continue;
+
+        Callback callback;
+        if (timer->second.period > 0)
+        {
+            callback = timer->second.callback;
+            timer->second.due = std::max(timer->second.due + timer->second.period, current + 1);
+            schedule(id, timer->second.due);
+        }
+        else
+        {
+            callback = std::move(timer->second.callback);
+            _timers.erase(timer);
+        }
+
+        _running = id;
+        lock.unlock();
+        callback();
+        lock.lock();
+        _running = 0;
+        _done.notify_all();
+    }
+}
+
+void TimerWheel::loop()
+{
+    setThreadName("timer");
+    log_d("Timer thread started");
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_active)
+    {
+        uint64_t current = now();
+        // After a long sleep every slot is visited once and overdue timers fire right away
+        uint64_t from = std::max(_processed + 1, current >= TIMER_WHEEL_SLOTS ? current - TIMER_WHEEL_SLOTS + 1 : 0);
+        for (uint64_t tick = from; tick <= current && _active; tick++)
+            process(tick, current, lock);
+        _processed = current;
+
+        _sleepUntil = nearest();
+        if (_sleepUntil == UINT64_MAX)
+            _cv.wait(lock);
+        else if (_sleepUntil > now())
+            _cv.wait_until(lock, _start + std::chrono::milliseconds(_sleepUntil * TIMER_WHEEL_TICK));
+    }
+
+    log_v("Timer thread stopped");
+}
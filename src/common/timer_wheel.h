@@ -0,0 +1,79 @@
+#ifndef SRC_COMMON_TIMER_WHEEL
+#define SRC_COMMON_TIMER_WHEEL
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define TIMER_WHEEL_TICK 5    // ms, timer resolution
+#define TIMER_WHEEL_SLOTS 256 // one turn of the wheel is 1.28s, longer delays wait for their turn
+
+// Process wide timer thread for periodic protocol and watchdog work.
+// Timers are hashed into wheel slots by due tick, so adding and cancelling is constant time.
+// The thread sleeps until the next filled slot and not at all while the wheel is empty.
+// Callbacks run on the timer thread and must be short, they may add and cancel timers.
+class TimerWheel
+{
+public:
+    using Id = uint32_t;
+    using Callback = std::function<void()>;
+
+    static TimerWheel &instance()
+    {
+        static TimerWheel wheel;
+        return wheel;
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Runs callback after delay and then every period when it is not zero, never returns 0
+    Id add(uint32_t delayMs, uint32_t periodMs, Callback callback);
+    Id once(uint32_t delayMs, Callback callback) { return add(delayMs, 0, std::move(callback)); }
+    Id every(uint32_t periodMs, Callback callback) { return add(periodMs, periodMs, std::move(callback)); }
+
+    // Callback is not running and won't run once this returns, false when timer already finished
+    bool cancel(Id id);
+
+    size_t count() const;
+
+private:
+    struct Timer
+    {
+        uint64_t due;
+        uint32_t period;
+        Callback callback;
+    };
+
+    TimerWheel();
+    ~TimerWheel();
+
+    uint64_t now() const;
+    static uint64_t ticks(uint32_t ms) { return (ms + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK; }
+    void schedule(Id id, uint64_t due) { _slots[due % TIMER_WHEEL_SLOTS].push_back(id); }
+    uint64_t nearest() const;
+    void process(uint64_t tick, uint64_t current, std::unique_lock<std::mutex> &lock);
+    void loop();
+
+    const std::chrono::steady_clock::time_point _start;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::condition_variable _done;
+    std::thread _thread;
+    bool _active;
+
+    std::vector<Id> _slots[TIMER_WHEEL_SLOTS];
+    std::unordered_map<Id, Timer> _timers;
+    Id _nextId;
+    uint64_t _processed; // Last tick that was handled
+    uint64_t _sleepUntil;
+    Id _running; // Timer with callback in progress, cancel waits for it
+    std::thread::id _runner;
+};
+
+#endif /* SRC_COMMON_TIMER_WHEEL */
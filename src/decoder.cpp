@@ -1,6 +1,8 @@
 #include "decoder.h"
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 #include "common/logger.h"
 #include "common/functions.h"
 #include "settings.h"
@@ -9,8 +11,21 @@ Decoder::Decoder()
     : buffer(Settings::renderingBuffer),
       _context(nullptr),
       _active(false),
-      _data(nullptr)
+      _flush(false),
+      _direct(false),
+      _data(nullptr),
+      _counter(0),
+      _frames{0, 0},
+      _latency{0, 0},
+      _frameTime(0),
+      _sent(0),
+      _backlogged(false),
+      _catchupHold(0),
+      _catchup(DECODER_CATCHUP_NONE),
+      _catchups{0, 0, 0}
 {
+    for (std::atomic<uint32_t> &bucket : _histogram)
+        bucket.store(0, std::memory_order_relaxed);
 }
 
 Decoder::~Decoder()
@@ -18,7 +33,7 @@ Decoder::~Decoder()
     stop();
 }
 
-void Decoder::start(AtomicQueue<Message> *data, AVCodecID codecId)
+void Decoder::start(VideoQueue *data, AVCodecID codecId)
 {
     if (_active)
         stop();
@@ -26,6 +41,13 @@ void Decoder::start(AtomicQueue<Message> *data, AVCodecID codecId)
     buffer.reset();
     _data = data;
     _codecId = codecId;
+    _direct = Settings::videoDirect && codecId == AV_CODEC_ID_H264;
+    _flush = false;
+    _frameTime = 0;
+    _sent = 0;
+    _backlogged = false;
+    _catchupHold = 0;
+    _catchup = DECODER_CATCHUP_NONE;
     _active = true;
     _thread = std::thread(&Decoder::runner, this);
 }
@@ -42,8 +64,105 @@ void Decoder::stop()
 
 void Decoder::flush()
 {
-    if (_context)
-        avcodec_flush_buffers(_context);
+    // Codec and parser belong to the decoder thread, it resets them before taking the next packet
+    _flush = true;
+}
+
+std::string Decoder::stats() const
+{
+    std::ostringstream out;
+    const char *names[] = {"direct", "parsed"};
+    for (uint8_t i = DECODER_FEED_DIRECT; i <= DECODER_FEED_PARSER; i++)
+    {
+        uint32_t frames = _frames[i].load(std::memory_order_relaxed);
+        out << (i > 0 ? " " : "") << names[i] << " " << frames << " ~"
+            << (frames > 0 ? _latency[i].load(std::memory_order_relaxed) / frames : 0) << "us";
+    }
+    out << " catchup " << static_cast<int>(_catchup.load(std::memory_order_relaxed))
+        << " deblock " << _catchups[DECODER_CATCHUP_DEBLOCK].load(std::memory_order_relaxed)
+        << " nonref " << _catchups[DECODER_CATCHUP_NONREF].load(std::memory_order_relaxed);
+    return out.str();
+}
+
+uint32_t Decoder::frames() const
+{
+    return _frames[DECODER_FEED_DIRECT].load(std::memory_order_relaxed) + _frames[DECODER_FEED_PARSER].load(std::memory_order_relaxed);
+}
+
+uint32_t Decoder::percentile(double share) const
+{
+    uint64_t total = frames();
+    if (total == 0)
+        return 0;
+
+    uint64_t target = static_cast<uint64_t>(share * total);
+    uint64_t counted = 0;
+    for (uint32_t i = 0; i < DECODER_HISTOGRAM_SIZE; i++)
+    {
+        counted += _histogram[i].load(std::memory_order_relaxed);
+        if (counted > target)
+            return (i + 1) * DECODER_HISTOGRAM_STEP;
+    }
+    return DECODER_HISTOGRAM_SIZE * DECODER_HISTOGRAM_STEP;
+}
+
+// Packet is one whole access unit when it starts with a start code followed by a valid NAL header
+// and carries picture or parameter sets. Anything else may be a part of a frame and needs the parser.
+bool Decoder::accessUnit(const uint8_t *data, int size)
+{
+    int offset = 0;
+    if (size >= 4 && data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 1)
+        offset = 4;
+    else if (size >= 3 && data[0] == 0 && data[1] == 0 && data[2] == 1)
+        offset = 3;
+    else
+        return false;
+
+    if (offset >= size)
+        return false;
+
+    // Forbidden zero bit must be clear, types 24..31 are not used in H.264 byte stream
+    uint8_t header = data[offset];
+    uint8_t type = header & 0x1f;
+    if ((header & 0x80) != 0 || type == 0 || type >= 24)
+        return false;
+
+    return (VideoQueue::classify(data, size) & (VIDEO_FRAME_SLICE | VIDEO_FRAME_CONFIG)) != 0;
+}
+
+// Packet without buffer reference is copied by libavcodec, so payload is handed over to the decoder instead.
+// Storage goes back to usb slot or buffer pool once the decoder unreferences the packet.
+AVBufferRef *Decoder::share(Message &segment)
+{
+    uint8_t *buffer;
+    uint32_t size;
+    Message::PayloadFree release;
+    void *opaque;
+    if (!segment.detach(buffer, size, release, opaque))
+        return nullptr;
+
+    AVBufferRef *result = av_buffer_create(buffer, size, release, opaque, AV_BUFFER_FLAG_READONLY);
+    if (!result)
+        release(opaque, buffer);
+    return result;
+}
+
+void Decoder::threading(AVCodecContext *context, int mode, int threads, int width, int height)
+{
+    if (threads <= 0)
+        threads = std::min<int>(std::max<unsigned>(std::thread::hardware_concurrency(), 1), DECODER_MAX_THREADS);
+
+    // Frame threads cost a frame of delay each, worth it only when one core can't keep up
+    if (mode == DECODER_THREADING_AUTO)
+        mode = width * height >= DECODER_FRAME_THREADING ? DECODER_THREADING_FRAME : DECODER_THREADING_SLICE;
+
+    if (mode == DECODER_THREADING_SLICE)
+        context->thread_type = FF_THREAD_SLICE;
+    else if (mode == DECODER_THREADING_FRAME)
+        context->thread_type = FF_THREAD_FRAME;
+    else
+        return;
+    context->thread_count = threads;
 }
 
 // Initialize and select the best decoder (try HW first, then SW)
@@ -108,6 +227,8 @@ AVCodecContext *Decoder::load_codec(AVCodecID codec_id)
         return nullptr;
     }
 
+    threading(result, Settings::decodeThreading, Settings::decodeThreads, Settings::width, Settings::height);
+
     int ret = avcodec_open2(result, codec, nullptr);
     if (ret < 0)
     {
@@ -116,7 +237,9 @@ AVCodecContext *Decoder::load_codec(AVCodecID codec_id)
         return nullptr;
     }
 
-    log_i("SW decoder %s", codec->name);
+    // Codec may not support the requested threading, active type is what it really uses
+    const char *threads = result->active_thread_type == FF_THREAD_FRAME ? "frame" : (result->active_thread_type == FF_THREAD_SLICE ? "slice" : "no");
+    log_i("SW decoder %s > %s threading, %d threads", codec->name, threads, result->thread_count);
     return result;
 }
 
@@ -161,20 +284,77 @@ void Decoder::runner()
     }
     avcodec_free_context(&_context);
     _context = nullptr;
+    log_i("Video decoder stopped > %s", stats().c_str());
 }
 
-void Decoder::loop(AVCodecContext *context, AVCodecParserContext *parser, AVPacket *packet, AVFrame *frame)
+void Decoder::loop(AVCodecContext *context, AVCodecParserContext *&parser, AVPacket *packet, AVFrame *frame)
 {
-    uint32_t counter = 0;
+    _counter = 0;
+    // Oldest packet which bytes may still be held in the parser
+    std::chrono::steady_clock::time_point fed;
+    bool holding = false;
 
     // Main decoding loop; runs until global_quit flag is set
     while (_data->wait(_active))
     {
+        if (_flush.exchange(false))
+        {
+            avcodec_flush_buffers(context);
+            // Parser still holds bytes of the old stream, a new one starts clean
+            AVCodecParserContext *fresh = av_parser_init(_codecId);
+            if (fresh)
+            {
+                av_parser_close(parser);
+                parser = fresh;
+            }
+            else
+                log_w("Can't reset parser for codec %s", avcodec_get_name(_codecId));
+            holding = false;
+            resetCatchUp(context);
+            // New stream gets another chance to go without the parser
+            _direct = Settings::videoDirect && _codecId == AV_CODEC_ID_H264;
+        }
+
         // Get raw data segment from queue
         std::unique_ptr<Message> segment = _data->pop();
+        if (!segment)
+            continue;
+        std::chrono::steady_clock::time_point popped = std::chrono::steady_clock::now();
         uint8_t *data_ptr = segment->data();
         int data_size = segment->length();
 
+        // Dongle sends whole frames, the parser would hold the last NAL of every frame until next packet arrives
+        if (_direct && accessUnit(data_ptr, data_size))
+        {
+            av_packet_unref(packet);
+            // Payload may move to padded storage while handed over
+            packet->buf = share(*segment);
+            if (packet->buf)
+                data_ptr = packet->buf->data + segment->offset();
+            else if (!segment->data())
+            {
+                log_w("Video packet dropped > can't reference payload");
+                continue;
+            }
+            packet->data = data_ptr;
+            packet->size = data_size;
+            decode(context, packet, frame, popped, DECODER_FEED_DIRECT);
+            // Usb slot is given back without waiting for the next packet
+            av_packet_unref(packet);
+            continue;
+        }
+
+        // Once parser has bytes of the stream it keeps them, so fallback sticks until next flush
+        if (_direct)
+        {
+            _direct = false;
+            log_i("Video packet is not a whole frame, using parser");
+        }
+
+        if (!holding)
+            fed = popped;
+        holding = true;
+
         // Feed raw data into the parser and decoder
         while (_active && data_size > 0)
         {
@@ -203,24 +383,9 @@ void Decoder::loop(AVCodecContext *context, AVCodecParserContext *parser, AVPack
             packet->data = paket_data;
             packet->size = paket_size;
 
-            // Send packet to decoder
-            int send_ret = avcodec_send_packet(context, packet);
-            if (send_ret != 0)
-            {
-                log_w("Can't decode packet > %s", avErrorText(send_ret).c_str());
-                continue;
-            }
-            // Receive decoded frames
-            while (avcodec_receive_frame(context, frame) == 0 && _active)
-            {
-                AVFrame *out = buffer.write(counter++);
-                if (out)
-                {
-                    av_frame_unref(out);
-                    av_frame_move_ref(out, frame);
-                    buffer.commit();
-                }
-            }
+            decode(context, packet, frame, fed, DECODER_FEED_PARSER);
+            // Rest of the current segment stays in the parser
+            fed = popped;
         }
     }
 
@@ -230,7 +395,7 @@ void Decoder::loop(AVCodecContext *context, AVCodecParserContext *parser, AVPack
         avcodec_send_packet(context, nullptr);
         while (avcodec_receive_frame(context, frame) == 0)
         {
-            AVFrame *out = buffer.write(counter++);
+            AVFrame *out = buffer.write(_counter++);
             if (out)
             {
                 av_frame_unref(out);
@@ -240,3 +405,91 @@ void Decoder::loop(AVCodecContext *context, AVCodecParserContext *parser, AVPack
         }
     }
 }
+
+// Queued packets are turned into time with the current decoding speed, so a slow decoder
+// starts catching up earlier than a fast one with the same number of packets waiting.
+// Speed is taken from how often frames come out, send time says nothing once frame threads work in background.
+void Decoder::catchUp(AVCodecContext *context)
+{
+    if (Settings::catchupHigh <= 0)
+        return;
+
+    uint16_t backlog = _data->count();
+    uint32_t lag = backlog * _frameTime / 1000;
+    uint8_t level = _catchup.load(std::memory_order_relaxed);
+    uint8_t target = level;
+
+    if (_catchupHold > 0)
+        _catchupHold--;
+    // Give every level some packets to show effect before going further
+    if (lag >= static_cast<uint32_t>(Settings::catchupHigh) && level < DECODER_CATCHUP_NONREF && _catchupHold == 0)
+        target = level + 1;
+    else if (lag <= static_cast<uint32_t>(Settings::catchupLow) && level != DECODER_CATCHUP_NONE)
+        target = DECODER_CATCHUP_NONE;
+
+    if (target == level)
+        return;
+
+    context->skip_loop_filter = target >= DECODER_CATCHUP_DEBLOCK ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+    context->skip_frame = target >= DECODER_CATCHUP_NONREF ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    _catchup = target;
+    _catchupHold = DECODER_CATCHUP_HOLD;
+    _catchups[target].fetch_add(1, std::memory_order_relaxed);
+
+    const char *names[] = {"back to normal", "skips deblocking", "skips non reference frames"};
+    log_i("Video decoder %s > queue %u, ~%ums behind, ~%uus per packet", names[target], backlog, lag, _frameTime);
+}
+
+// New stream starts with everything decoded, speed stays as it is the same codec
+void Decoder::resetCatchUp(AVCodecContext *context)
+{
+    context->skip_loop_filter = AVDISCARD_DEFAULT;
+    context->skip_frame = AVDISCARD_DEFAULT;
+    _catchup = DECODER_CATCHUP_NONE;
+    _catchupHold = 0;
+    _sent = 0;
+    _backlogged = false;
+}
+
+void Decoder::decode(AVCodecContext *context, AVPacket *packet, AVFrame *frame, std::chrono::steady_clock::time_point fed, uint8_t feed)
+{
+    catchUp(context);
+
+    // Send packet to decoder
+    int send_ret = avcodec_send_packet(context, packet);
+    if (send_ret != 0)
+    {
+        log_w("Can't decode packet > %s", avErrorText(send_ret).c_str());
+        return;
+    }
+    _sent++;
+    // Receive decoded frames
+    while (avcodec_receive_frame(context, frame) == 0 && _active)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        // Interval is decoding speed only when packets were already waiting at the previous frame,
+        // otherwise it includes time spent waiting for the phone.
+        // Skipped frames don't come out, so time is shared by all packets sent since the last frame.
+        if (_backlogged && _sent > 0)
+        {
+            uint32_t spent = std::chrono::duration_cast<std::chrono::microseconds>(now - _lastFrame).count() / _sent;
+            _frameTime = _frameTime ? (_frameTime * 7 + spent) / 8 : spent;
+        }
+        _lastFrame = now;
+        _sent = 0;
+        _backlogged = _data->count() > 0;
+
+        uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(now - fed).count();
+        _latency[feed].fetch_add(latency, std::memory_order_relaxed);
+        _histogram[std::min<uint64_t>(latency / DECODER_HISTOGRAM_STEP, DECODER_HISTOGRAM_SIZE - 1)].fetch_add(1, std::memory_order_relaxed);
+        _frames[feed].fetch_add(1, std::memory_order_relaxed);
+
+        AVFrame *out = buffer.write(_counter++);
+        if (out)
+        {
+            av_frame_unref(out);
+            av_frame_move_ref(out, frame);
+            buffer.commit();
+        }
+    }
+}
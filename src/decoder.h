@@ -8,11 +8,31 @@ extern "C"
 }
 
 #include <atomic>
+#include <chrono>
+#include <string>
 #include <thread>
 
 #include "struct/video_buffer.h"
-#include "struct/atomic_queue.h"
 #include "protocol/message.h"
+#include "protocol/video_queue.h"
+
+#define DECODER_FEED_DIRECT 0 // Packet is sent to decoder as it came from the dongle
+#define DECODER_FEED_PARSER 1 // Packet went through the parser
+
+#define DECODER_CATCHUP_NONE 0     // Everything is decoded
+#define DECODER_CATCHUP_DEBLOCK 1  // Loop filter is skipped
+#define DECODER_CATCHUP_NONREF 2   // Loop filter and non reference frames are skipped
+#define DECODER_CATCHUP_HOLD 8     // Packets to decode before going one level further
+
+#define DECODER_THREADING_DEFAULT 0
+#define DECODER_THREADING_SLICE 1
+#define DECODER_THREADING_FRAME 2
+#define DECODER_THREADING_AUTO 3
+#define DECODER_MAX_THREADS 4                  // Default thread count is one per core up to this
+#define DECODER_FRAME_THREADING (1920 * 1080) // Pixels from which auto mode uses frame threads
+
+#define DECODER_HISTOGRAM_STEP 250  // us, latency histogram bucket
+#define DECODER_HISTOGRAM_SIZE 400  // Last bucket takes everything from 100ms
 
 class Decoder
 {
@@ -20,22 +40,48 @@ public:
     Decoder();
     ~Decoder();
 
-    void start(AtomicQueue<Message> *data, AVCodecID codecId);
+    void start(VideoQueue *data, AVCodecID codecId);
     void stop();
+    // Asks decoder thread to drop codec and parser state before the next packet of a new stream
     void flush();
+    // Frames and average time from taking the packet from queue to decoded frame for both feed modes
+    std::string stats() const;
+    uint32_t frames() const;
+    // Latency in microseconds the given share of frames stays under, histogram step precision
+    uint32_t percentile(double share) const;
 
     VideoBuffer buffer;
 
 private:
     void runner();
-    void loop(AVCodecContext *context, AVCodecParserContext *parser, AVPacket *packet, AVFrame *frame);
+    void loop(AVCodecContext *context, AVCodecParserContext *&parser, AVPacket *packet, AVFrame *frame);
+    void decode(AVCodecContext *context, AVPacket *packet, AVFrame *frame, std::chrono::steady_clock::time_point fed, uint8_t feed);
+    void catchUp(AVCodecContext *context);
+    void resetCatchUp(AVCodecContext *context);
+    static bool accessUnit(const uint8_t *data, int size);
+    static AVBufferRef *share(Message &segment);
+    // Sets up software decoder threads before it is opened
+    static void threading(AVCodecContext *context, int mode, int threads, int width, int height);
     static AVCodecContext *load_codec(AVCodecID codec_id);
 
     std::thread _thread;
     AVCodecContext* _context;
     AVCodecID _codecId;
     std::atomic<bool> _active;
-    AtomicQueue<Message> *_data;
+    std::atomic<bool> _flush;
+    bool _direct;
+    VideoQueue *_data;
+    uint32_t _counter;
+    std::atomic<uint32_t> _frames[2];
+    std::atomic<uint64_t> _latency[2]; // Microseconds, summed over frames
+    std::atomic<uint32_t> _histogram[DECODER_HISTOGRAM_SIZE];
+    uint32_t _frameTime;               // Microseconds per packet between frames while busy, running average
+    std::chrono::steady_clock::time_point _lastFrame;
+    uint32_t _sent;                    // Packets sent to codec since the last frame came out
+    bool _backlogged;                  // Queue was not empty when the last frame came out
+    uint32_t _catchupHold;
+    std::atomic<uint8_t> _catchup;
+    std::atomic<uint32_t> _catchups[3]; // Times each level was entered
 };
 
 #endif /* SRC_DECODER */
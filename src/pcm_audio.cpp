@@ -3,7 +3,7 @@
 #include "protocol/protocol_const.h"
 #include "settings.h"
 #include "common/logger.h"
-#include <time.h>
+#include "common/timer_wheel.h"
 
 // Add sample size (buffer size in samples) to ChannelConfig
 ChannelConfig PcmAudio::_configTable[] = {
@@ -19,9 +19,10 @@ PcmAudio::PcmAudio(const char *name) : _name("default"),
                                        _playing(false),
                                        _active(false),
                                        _fade(false),
-                                       _config({0, 0, 0}),
+                                       _stale(false),
                                        _volume(1),
-                                       _fadedVolume(Settings::audioFade)
+                                       _fadedVolume(Settings::audioFade),
+                                       _watchdog(0)
 {
     if (name && strlen(name) > 0)
         _name = name;
@@ -31,8 +32,6 @@ PcmAudio::PcmAudio(const char *name) : _name("default"),
 PcmAudio::~PcmAudio()
 {
     stop();
-    if (_thread.joinable())
-        _thread.join();
     log_v("Destroyed %s", _name.c_str());
 }
 
@@ -54,6 +53,9 @@ void PcmAudio::stop()
     log_v("Stopping %s", _name.c_str());
     _active = false;
     _data->notify();
+    // Joined so the player can be restarted on another queue
+    if (_thread.joinable())
+        _thread.join();
 }
 
 ChannelConfig PcmAudio::getConfig(const Message *msg)
@@ -200,10 +202,15 @@ void PcmAudio::loop()
 
     log_d("Started thread %s", _name.c_str());
 
+    // Device lives only as long as the thread, so its format does too
     SDL_AudioDeviceID device = 0;
+    ChannelConfig opened = {0, 0, 0};
     SDL_AudioSpec spec;
 
-    time_t playEnd = time(NULL);
+    // Audio queued before a long pause is stale, watchdog marks it so instead of checking clock on every segment
+    _stale = false;
+    _watchdog = TimerWheel::instance().once(AUDIO_RESET_SECONDS * 1000, [this]()
+                                            { _stale = true; });
     while (_data->wait(_active))
     {
         const Message *segment = _data->peek();
@@ -211,7 +218,7 @@ void PcmAudio::loop()
             continue;
 
         ChannelConfig config = getConfig(segment);
-        if (_config != config)
+        if (opened != config)
         {
             if (device != 0)
             {
@@ -241,10 +248,11 @@ void PcmAudio::loop()
                 SDL_Delay(100);
                 continue;
             }
-            _config = config;
+            opened = config;
         }
 
-        if (difftime(time(NULL), playEnd) > AUDIO_RESET_SECONDS)
+        TimerWheel::instance().cancel(_watchdog);
+        if (_stale.exchange(false))
             SDL_ClearQueuedAudio(device);
 
         if (_fader)
@@ -254,13 +262,15 @@ void PcmAudio::loop()
         if (_fader)
             _fader->fade(false);
         SDL_PauseAudioDevice(device, 1);
-        playEnd = time(NULL);
+        _watchdog = TimerWheel::instance().once(AUDIO_RESET_SECONDS * 1000, [this]()
+                                                { _stale = true; });
         log_d("Stop playing %s %dkHz %s",
               _name.c_str(),
               config.rate,
               (config.channels == 2 ? "stereo" : "mono"));
     }
 
+    TimerWheel::instance().cancel(_watchdog);
     if (device != 0)
     {
         SDL_ClearQueuedAudio(device);
@@ -7,6 +7,7 @@
 
 #include <SDL2/SDL.h>
 
+#include "common/timer_wheel.h"
 #include "struct/atomic_queue.h"
 #include "protocol/message.h"
 
@@ -59,10 +60,11 @@ private:
     std::atomic<bool> _playing;
     std::atomic<bool> _active;
     std::atomic<bool> _fade;
-    ChannelConfig _config;
+    std::atomic<bool> _stale;
     AtomicQueue<Message> *_data;
     float _volume;
     float _fadedVolume;
+    TimerWheel::Id _watchdog;
 };
 
 #endif /* SRC_PCM_AUDIO */
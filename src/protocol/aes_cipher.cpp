@@ -1,19 +1,24 @@
 #include "aes_cipher.h"
 
-#include <algorithm>
 #include <cstdlib>
 #include <ctime>
-#include <memory>
-#include <openssl/aes.h>
 #include <openssl/evp.h>
 #include <stdexcept>
 
-AESCipher::AESCipher(const std::string &baseKey)
-    : _baseKey(baseKey)
+static uint32_t randomSeed()
 {
     std::srand(std::time(nullptr));
-    _seed = static_cast<uint32_t>(std::rand());
+    return static_cast<uint32_t>(std::rand());
+}
 
+AESCipher::AESCipher(const std::string &baseKey)
+    : AESCipher(baseKey, randomSeed())
+{
+}
+
+AESCipher::AESCipher(const std::string &baseKey, uint32_t seed)
+    : _baseKey(baseKey), _seed(seed), _encCtx(nullptr), _decCtx(nullptr)
+{
     if (_baseKey.size() != keyLength)
     {
         throw std::invalid_argument("Base key must be exactly 16 bytes");
@@ -29,6 +34,23 @@ AESCipher::AESCipher(const std::string &baseKey)
     _initVec[4] = static_cast<uint8_t>(_seed >> 8);
     _initVec[9] = static_cast<uint8_t>(_seed >> 16);
     _initVec[12] = static_cast<uint8_t>(_seed >> 24);
+
+    _encCtx = EVP_CIPHER_CTX_new();
+    _decCtx = EVP_CIPHER_CTX_new();
+    if (!_encCtx || !_decCtx ||
+        EVP_EncryptInit_ex(_encCtx, EVP_aes_128_cfb(), nullptr, _encKey.data(), _initVec.data()) != 1 ||
+        EVP_DecryptInit_ex(_decCtx, EVP_aes_128_cfb(), nullptr, _encKey.data(), _initVec.data()) != 1)
+    {
+        EVP_CIPHER_CTX_free(_encCtx);
+        EVP_CIPHER_CTX_free(_decCtx);
+        throw std::runtime_error("Cipher context initialization failed");
+    }
+}
+
+AESCipher::~AESCipher()
+{
+    EVP_CIPHER_CTX_free(_encCtx);
+    EVP_CIPHER_CTX_free(_decCtx);
 }
 
 bool AESCipher::encrypt(uint8_t *data, uint32_t length, char *err) const
@@ -36,23 +58,15 @@ bool AESCipher::encrypt(uint8_t *data, uint32_t length, char *err) const
     if (!data || length == 0)
         return error(err, "Empty data");
 
-    auto ctx = std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
-    if (!ctx)
-        return error(err, "Failed to create cipher context");
-
-    if (EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_cfb(), nullptr, _encKey.data(), _initVec.data()) != 1)
+    // Same key, only the IV goes back to its initial value
+    if (EVP_EncryptInit_ex(_encCtx, nullptr, nullptr, nullptr, _initVec.data()) != 1)
         return error(err, "Encryption initialization failed");
 
-    std::unique_ptr<uint8_t[]> temp(new uint8_t[length + AES_BLOCK_SIZE]);
-    int out_len = 0;
-    if (EVP_EncryptUpdate(ctx.get(), temp.get(), &out_len, data, length) != 1)
+    // CFB is a stream mode, output is the same size as input and can be written in place
+    int outLength = 0;
+    if (EVP_EncryptUpdate(_encCtx, data, &outLength, data, length) != 1 || static_cast<uint32_t>(outLength) != length)
         return error(err, "Encryption failed during update");
 
-    int final_len = 0;
-    if (EVP_EncryptFinal_ex(ctx.get(), temp.get() + out_len, &final_len) != 1)
-        return error(err, "Encryption failed during final");
-
-    std::copy_n(temp.get(), length, data);
     return true;
 }
 
@@ -61,22 +75,12 @@ bool AESCipher::decrypt(uint8_t *data, uint32_t length, char *err) const
     if (!data || length == 0)
         return error(err, "Empty data");
 
-    auto ctx = std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
-    if (!ctx)
-        return error(err, "Failed to create cipher context");
-
-    if (EVP_DecryptInit_ex(ctx.get(), EVP_aes_128_cfb(), nullptr, _encKey.data(), _initVec.data()) != 1)
+    if (EVP_DecryptInit_ex(_decCtx, nullptr, nullptr, nullptr, _initVec.data()) != 1)
         return error(err, "Decryption initialization failed");
 
-    std::unique_ptr<uint8_t[]> temp(new uint8_t[length + AES_BLOCK_SIZE]);
-    int out_len = 0;
-    if (EVP_DecryptUpdate(ctx.get(), temp.get(), &out_len, data, length) != 1)
+    int outLength = 0;
+    if (EVP_DecryptUpdate(_decCtx, data, &outLength, data, length) != 1 || static_cast<uint32_t>(outLength) != length)
         return error(err, "Decryption failed during update");
 
-    int final_len = 0;
-    if (EVP_DecryptFinal_ex(ctx.get(), temp.get() + out_len, &final_len) != 1)
-        return error(err, "Decryption failed during final");
-
-    std::copy_n(temp.get(), length, data);
     return true;
 }
@@ -7,13 +7,22 @@
 #include <cstring>
 #include <string>
 
+struct evp_cipher_ctx_st;
+
+// AES-128-CFB with key and IV derived from the seed.
+// Key schedule is done once, every message only resets the IV. Encryption and decryption
+// have separate contexts, each direction must be used from one thread at a time.
 class AESCipher
 {
 public:
     static constexpr size_t keyLength = 16;
 
     AESCipher(const std::string &base_key);
-    ~AESCipher() = default;
+    AESCipher(const std::string &base_key, uint32_t seed);
+    ~AESCipher();
+
+    AESCipher(const AESCipher &) = delete;
+    AESCipher &operator=(const AESCipher &) = delete;
 
     bool encrypt(uint8_t *data, uint32_t length, char *err) const;
     bool decrypt(uint8_t *data, uint32_t length, char *err) const;
@@ -33,6 +42,8 @@ private:
     uint32_t _seed;
     std::array<uint8_t, keyLength> _encKey;
     std::array<uint8_t, keyLength> _initVec;
+    evp_cipher_ctx_st *_encCtx;
+    evp_cipher_ctx_st *_decCtx;
 };
 
 #endif /* SRC_AES_CIPHER */
@@ -0,0 +1,177 @@
+#include "protocol/capture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "common/logger.h"
+#include "common/threading.h"
+
+CaptureRing::CaptureRing(uint32_t capacity)
+    : _data(new uint8_t[capacity]), _capacity(capacity), _head(0), _tail(0)
+{
+}
+
+bool CaptureRing::push(const CaptureRecord &record, const uint8_t *data)
+{
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    uint64_t need = sizeof(CaptureRecord) + record.length;
+    if (need > _capacity - (head - _tail.load(std::memory_order_acquire)))
+        return false;
+
+    copyIn(head, &record, sizeof(CaptureRecord));
+    copyIn(head + sizeof(CaptureRecord), data, record.length);
+    _head.store(head + need, std::memory_order_release);
+    return true;
+}
+
+bool CaptureRing::peek(CaptureRecord &record) const
+{
+    uint64_t tail = _tail.load(std::memory_order_relaxed);
+    if (_head.load(std::memory_order_acquire) - tail < sizeof(CaptureRecord))
+        return false;
+    copyOut(tail, &record, sizeof(CaptureRecord));
+    return true;
+}
+
+bool CaptureRing::write(FILE *file)
+{
+    CaptureRecord record;
+    if (!peek(record))
+        return false;
+
+    uint64_t tail = _tail.load(std::memory_order_relaxed);
+    fwrite(&record, sizeof(CaptureRecord), 1, file);
+
+    // Payload can wrap around the end of the ring
+    uint32_t start = (tail + sizeof(CaptureRecord)) % _capacity;
+    uint32_t first = std::min(record.length, _capacity - start);
+    if (first > 0)
+        fwrite(_data.get() + start, first, 1, file);
+    if (record.length > first)
+        fwrite(_data.get(), record.length - first, 1, file);
+
+    _tail.store(tail + sizeof(CaptureRecord) + record.length, std::memory_order_release);
+    return true;
+}
+
+void CaptureRing::copyIn(uint64_t position, const void *src, uint32_t length)
+{
+    uint32_t start = position % _capacity;
+    uint32_t first = std::min(length, _capacity - start);
+    std::memcpy(_data.get() + start, src, first);
+    std::memcpy(_data.get(), static_cast<const uint8_t *>(src) + first, length - first);
+}
+
+void CaptureRing::copyOut(uint64_t position, void *dst, uint32_t length) const
+{
+    uint32_t start = position % _capacity;
+    uint32_t first = std::min(length, _capacity - start);
+    std::memcpy(dst, _data.get() + start, first);
+    std::memcpy(static_cast<uint8_t *>(dst) + first, _data.get(), length - first);
+}
+
+CaptureWriter::CaptureWriter()
+    : _file(nullptr), _active(false), _dropped(0), _records(0)
+{
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    stop();
+}
+
+bool CaptureWriter::start(const std::string &path, uint32_t bufferSize)
+{
+    if (_active)
+        return true;
+
+    _file = fopen(path.c_str(), "wb");
+    if (!_file)
+    {
+        log_w("Can't open usb capture file %s", path.c_str());
+        return false;
+    }
+
+    CaptureHeader header{CAPTURE_MAGIC, CAPTURE_VERSION};
+    fwrite(&header, sizeof(header), 1, _file);
+
+    for (std::unique_ptr<CaptureRing> &ring : _rings)
+    {
+        if (!ring)
+            ring = std::make_unique<CaptureRing>(bufferSize);
+    }
+
+    _dropped = 0;
+    _records = 0;
+    _active = true;
+    _thread = std::thread(&CaptureWriter::writeLoop, this);
+    log_i("Capturing usb data to %s", path.c_str());
+    return true;
+}
+
+void CaptureWriter::stop()
+{
+    if (!_active)
+        return;
+
+    _active = false;
+    if (_thread.joinable())
+        _thread.join();
+
+    fclose(_file);
+    _file = nullptr;
+
+    log_i("USB capture stopped > %llu records, %u dropped", static_cast<unsigned long long>(_records), _dropped.load());
+}
+
+void CaptureWriter::capture(uint8_t direction, const uint8_t *data, uint32_t length)
+{
+    if (!_active.load(std::memory_order_relaxed) || direction > CAPTURE_OUTBOUND)
+        return;
+
+    CaptureRecord record{};
+    record.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    record.length = length;
+    record.direction = direction;
+
+    if (!_rings[direction]->push(record, data))
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool CaptureWriter::drain()
+{
+    bool result = false;
+    CaptureRecord in;
+    CaptureRecord out;
+
+    // Both rings are in time order, merge them so the file is too
+    while (true)
+    {
+        bool hasIn = _rings[CAPTURE_INBOUND]->peek(in);
+        bool hasOut = _rings[CAPTURE_OUTBOUND]->peek(out);
+        if (!hasIn && !hasOut)
+            return result;
+
+        if (hasIn && (!hasOut || in.timestamp <= out.timestamp))
+            _rings[CAPTURE_INBOUND]->write(_file);
+        else
+            _rings[CAPTURE_OUTBOUND]->write(_file);
+        _records++;
+        result = true;
+    }
+}
+
+void CaptureWriter::writeLoop()
+{
+    setThreadName("usb-capture");
+
+    while (_active)
+    {
+        if (!drain())
+            std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_FLUSH_INTERVAL));
+    }
+
+    drain();
+    fflush(_file);
+}
@@ -0,0 +1,92 @@
+#ifndef SRC_PROTOCOL_CAPTURE
+#define SRC_PROTOCOL_CAPTURE
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Raw usb session file: CaptureHeader followed by records, each record is
+// CaptureRecord followed by length bytes exactly as they went over usb.
+#define CAPTURE_MAGIC 0x50414346 // "FCAP"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_INBOUND 0  // Dongle to host, one completed read transfer
+#define CAPTURE_OUTBOUND 1 // Host to dongle, one write transfer
+
+#define CAPTURE_FLUSH_INTERVAL 10
+
+#pragma pack(push, 1)
+struct CaptureHeader
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct CaptureRecord
+{
+    uint64_t timestamp; // Monotonic clock, microseconds
+    uint32_t length;
+    uint8_t direction;
+    uint8_t reserved[3];
+};
+#pragma pack(pop)
+
+// Single producer, single consumer ring of capture records, never blocks the producer
+class CaptureRing
+{
+public:
+    CaptureRing(uint32_t capacity);
+
+    CaptureRing(const CaptureRing &) = delete;
+    CaptureRing &operator=(const CaptureRing &) = delete;
+
+    // Producer side, false when there is no room for the whole record
+    bool push(const CaptureRecord &record, const uint8_t *data);
+
+    // Consumer side
+    bool peek(CaptureRecord &record) const;
+    bool write(FILE *file);
+
+private:
+    void copyIn(uint64_t position, const void *src, uint32_t length);
+    void copyOut(uint64_t position, void *dst, uint32_t length) const;
+
+    std::unique_ptr<uint8_t[]> _data;
+    uint32_t _capacity;
+    alignas(64) std::atomic<uint64_t> _head;
+    alignas(64) std::atomic<uint64_t> _tail;
+};
+
+// Writes inbound and outbound usb data to a capture file from a background thread.
+// Each direction has its own preallocated ring, records that do not fit are dropped and counted.
+class CaptureWriter
+{
+public:
+    CaptureWriter();
+    ~CaptureWriter();
+
+    bool start(const std::string &path, uint32_t bufferSize);
+    void stop();
+
+    // Called from usb reading thread for inbound and writing thread for outbound data
+    void capture(uint8_t direction, const uint8_t *data, uint32_t length);
+
+    bool active() const { return _active.load(std::memory_order_acquire); }
+    uint32_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+private:
+    void writeLoop();
+    bool drain();
+
+    std::unique_ptr<CaptureRing> _rings[2];
+    FILE *_file;
+    std::thread _thread;
+    std::atomic<bool> _active;
+    std::atomic<uint32_t> _dropped;
+    uint64_t _records;
+};
+
+#endif /* SRC_PROTOCOL_CAPTURE */
@@ -1,44 +1,51 @@
 #include "connection.h"
 
 #include <algorithm>
+#include <cstring>
 #include <ctime>
 #include <sstream>
 #include <stdexcept>
 
 #include "libavcodec/defs.h"
 
+#include "protocol/header_scanner.h"
 #include "protocol/message.h"
+#include "protocol/usb_tuner.h"
 #include "common/logger.h"
+#include "common/timer_wheel.h"
 #include "protocol/protocol_const.h"
 #include "common/functions.h"
 #include "settings.h"
 
-Connection::Connection()
-    : writeQueue(WRITE_QUEUE_SIZE),
-      videoStream(VIDEO_QUEUE_SIZE),
+Connection::Connection(Recorder &recorder, const std::string &device)
+    : videoStream(VIDEO_QUEUE_SIZE),
       audioStreamMain(AUDIO_QUEUE_SIZE),
       audioStreamAux(AUDIO_QUEUE_SIZE),
-      _processQueue(Settings::usbBuffer, Settings::usbTransferSize),
-      _transfers(Settings::usbQueue),
+      decryptStream(DECRYPT_QUEUE_SIZE),
+      _device(device),
+      _recorder(recorder),
+      _processQueue(Settings::usbBuffer, UsbTuner::maxSize(), AV_INPUT_BUFFER_PADDING_SIZE),
+      _transport(Transport::create(_processQueue, device)),
       _statusHandler(nullptr),
       _cipher(nullptr),
-      _context(nullptr),
+      _decryptPushed(0),
+      _decryptPopped(0),
       _active(false),
       _connected(false),
       _phoneConnected(false),
       _ecnrypt(false),
       _state(PROTOCOL_STATUS_INITIALISING),
-      _method("unknown"),
-      _phoneName("phone"),
-      _transfered(0)
+      _resyncs(0),
+      _skipped(0),
+      _unsent(0),
+      _firstFrame(false),
+      _heartbeat(0)
 {
-    int result = libusb_init(&_context);
-    if (result < 0)
-        throw std::runtime_error(std::string("Can't initialise USB: ") + libusb_error_name(result));
-
     try
     {
         _cipher = new AESCipher(ENCRYPTION_BASE);
+        // Cipher contexts are per thread, decrypt stage gets its own with the same key
+        _decryptCipher = std::make_unique<AESCipher>(_cipher->key(), _cipher->seed());
     }
     catch (const std::exception &e)
     {
@@ -51,13 +58,6 @@ Connection::Connection()
         log_w("Can't initialise cypher for encryption > Unknown error");
     }
 
-    for (Context &context : _transfers)
-    {
-        context.owner = this;
-        context.transfer = nullptr;
-        context.slot = nullptr;
-    }
-
     log_v("Created");
 }
 
@@ -66,26 +66,19 @@ Connection::~Connection()
     log_v("Destroying");
     stop();
 
+    // Queued messages can reference usb slots, release them before the buffer is gone
+    decryptStream.clear();
+    videoStream.clear();
+    audioStreamMain.clear();
+    audioStreamAux.clear();
+
     if (_cipher)
     {
         delete _cipher;
         _cipher = nullptr;
     }
 
-    for (Context &context : _transfers)
-    {
-        if (context.transfer)
-        {
-            libusb_free_transfer(context.transfer);
-            context.transfer = nullptr;
-        }
-    }
-
-    if (_context)
-    {
-        libusb_exit(_context);
-        _context = nullptr;
-    }
+    _transport.reset();
     log_v("Destroyed");
 }
 
@@ -98,19 +91,10 @@ void Connection::start()
 
     log_v("Starting");
 
-    // Prepare usb transfers
-    for (Context &context : _transfers)
-    {
-        if (!context.transfer)
-        {
-            context.transfer = libusb_alloc_transfer(0);
-            if (context.transfer == nullptr)
-            {
-                log_e("Can't allocate usb transfer");
-                return;
-            }
-        }
-    }
+    // Every session of a multi dongle setup writes its own capture file
+    std::string capturePath = Settings::usbCaptureFile.value + (_device.empty() ? "" : "." + _device);
+    if (Settings::usbCaptureFile.value.length() > 0 && _capture.start(capturePath, std::max(1, Settings::usbCaptureBuffer.value) * 1024 * 1024))
+        _transport->setCapture(&_capture);
 
     _active = true;
     _writeThread = std::thread(&Connection::mainLoop, this);
@@ -129,55 +113,18 @@ void Connection::stop()
 
     _processQueue.notify();
     writeQueue.notify();
+    _transport->notify();
 
     if (_writeThread.joinable())
         _writeThread.join();
 
+    _transport->setCapture(nullptr);
+    _capture.stop();
+
     log_v("Stopped");
     _statusHandler = nullptr;
 }
 
-void Connection::onTransfer(libusb_transfer *transfer)
-{
-    if (!transfer || !transfer->user_data)
-        return;
-
-    Context *c = static_cast<Context *>(transfer->user_data);
-    if (!c->owner->_connected)
-        return;
-
-    c->owner->_transfered.fetch_add(transfer->actual_length, std::memory_order_relaxed);
-    log_p("Transfer %d [%d] > %s", transfer->actual_length, transfer->status, bytes(transfer->buffer, transfer->actual_length, 40).c_str());
-
-    if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
-        return;
-
-    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
-    {
-        c->owner->_connected = false;
-        return;
-    }
-
-    if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
-    {
-        c->slot->commit(transfer->actual_length);
-        c->slot = c->owner->_processQueue.get();
-        if (!c->slot)
-        {
-            log_e("Can't allocate data slot for next usb transfer, increase usb buffer slots");
-            c->owner->_connected = false;
-            return;
-        }
-        c->transfer->buffer = c->slot->data;
-    }
-    int status = libusb_submit_transfer(c->transfer);
-    if (status != LIBUSB_SUCCESS)
-    {
-        log_w("USB transfer re-submit failed with status %d", status);
-        c->owner->_connected = false;
-    }
-}
-
 void Connection::mainLoop()
 {
     // Set thread name
@@ -190,36 +137,34 @@ void Connection::mainLoop()
     while (_active)
     {
         int linkCount = 0;
-        libusb_device_handle *handler = libusb_open_device_with_vid_pid(_context, Settings::vendorid, Settings::productid);
-        if (handler)
+        if (_transport->open())
         {
+            _opened = std::chrono::steady_clock::now();
             if (_state != PROTOCOL_STATUS_LINKING && _state != PROTOCOL_STATUS_ERROR)
                 connectCount = 0;
             _state = PROTOCOL_STATUS_LINKING;
             linkCount = 1;
-            uint8_t endpointIn = 0;
-            uint8_t endpointOut = 0;
-            libusb_device *device = nullptr;
+            bool linked = false;
             _ecnrypt = false;
             writeQueue.clear();
 
-            while (!device && linkCount++ < LINK_RETRY)
+            while (!linked && linkCount++ < LINK_RETRY)
             {
-                device = link(handler, &endpointIn, &endpointOut);
-                writeQueue.waitFor(_active, LINK_RETRY_TIMEOUT);
+                linked = _transport->link();
+                if (!linked)
+                    writeQueue.waitFor(_active, LINK_RETRY_TIMEOUT);
             }
 
-            if (device)
+            if (linked)
             {
                 _state = PROTOCOL_STATUS_ONLINE;
-                onDeviceConnect(handler, device, endpointIn);
-                writeLoop(handler, endpointOut);
+                onDeviceConnect();
+                writeLoop();
                 _state = PROTOCOL_STATUS_LINKING;
                 onDeviceDisconnect();
             }
 
-            libusb_release_interface(handler, 0);
-            libusb_close(handler);
+            _transport->close();
         }
         if (linkCount == 0)
         {
@@ -231,47 +176,44 @@ void Connection::mainLoop()
             if (_state != PROTOCOL_STATUS_ERROR && connectCount++ > CONNECT_RETRY)
                 _state = PROTOCOL_STATUS_ERROR;
         }
-        writeQueue.waitFor(_active, RECONNECT_TIMEOUT);
+        // Hotplug capable transport returns as soon as the dongle shows up
+        if (!_transport->waitDevice(_active, RECONNECT_TIMEOUT))
+            writeQueue.waitFor(_active, RECONNECT_TIMEOUT);
     }
 
     log_v("USB writing thread stopped");
 }
 
-void Connection::onDeviceConnect(libusb_device_handle *handler, libusb_device *device, uint8_t endpointIn)
+void Connection::onDeviceConnect()
 {
     _connected = true;
     _phoneConnected = false;
-    log_i("Device connected %d:%d speed: %d", libusb_get_bus_number(device), libusb_get_device_address(device), libusb_get_device_speed(device));
+    _firstFrame = true;
     writeQueue.clear();
+    decryptStream.clear();
+    {
+        std::lock_guard<std::mutex> lock(_gapMutex);
+        _decryptGaps.clear();
+    }
+    _decryptPushed = 0;
+    _decryptPopped = 0;
     videoStream.clear();
     audioStreamMain.clear();
     audioStreamAux.clear();
     _processQueue.reset();
 
     _processThread = std::thread(&Connection::processLoop, this);
-    _readThread = std::thread(&Connection::readLoop, this);
 
-    for (Context &context : _transfers)
-    {
-        context.owner = this;
-        context.slot = _processQueue.get();
-        if (context.slot == nullptr)
-        {
-            log_e("Can't allocate data slot for usb transfer, increase usb buffer slots");
-            _connected = false;
-            return;
-        }
-        libusb_fill_bulk_transfer(context.transfer, handler, endpointIn, context.slot->data, context.slot->size, Connection::onTransfer, &context, 0);
-        int status = libusb_submit_transfer(context.transfer);
-        if (status != LIBUSB_SUCCESS)
-        {
-            log_w("USB transfer submit failed with code %d", status);
-            _connected = false;
-            return;
-        }
-    }
+    if (!_transport->start(_connected))
+        _connected = false;
+    log_d("Transport started %.1fms after device open", elapsedMs(_opened));
 
-    sendInit();
+    if (_connected)
+        sendInit();
+
+    // Sent on schedule even when the queue never runs empty
+    _heartbeat = TimerWheel::instance().every(PROTOCOL_HEARTBEAT_DELAY, [this]()
+                                              { writeQueue.push(Message::HeartBeat()); });
 }
 
 void Connection::onDeviceDisconnect()
@@ -279,15 +221,20 @@ void Connection::onDeviceDisconnect()
     onPhoneDisconnect();
 
     log_i("Device disconnected");
+    TimerWheel::instance().cancel(_heartbeat);
+    _heartbeat = 0;
     _connected = false;
     _state = PROTOCOL_STATUS_ERROR;
     _processQueue.notify();
+    decryptStream.notify();
 
-    if (_readThread.joinable())
-        _readThread.join();
+    _transport->stop();
 
     if (_processThread.joinable())
         _processThread.join();
+    if (_decryptThread.joinable())
+        _decryptThread.join();
+    decryptStream.clear();
 }
 
 void Connection::onPhoneConnect()
@@ -310,37 +257,13 @@ void Connection::onPhoneDisconnect()
     log_i("Phone disconnected");
     _phoneConnected = false;
 
-    _recorder.stop();
+    _recorder.stop(&writeQueue);
     if (Settings::onDisconnect.value.length() > 1)
         execute(Settings::onDisconnect.value.c_str());
 
-    _method = "unknown";
-    _phoneName = "phone";
-}
-
-void Connection::readLoop()
-{
-    setThreadName("usb-read");
-    setThreadPriority(ThreadPriority::Realtime);
-    timeval timeout{0, 1000};
-
-    log_d("USB reading thread started");
-
-    while (_connected)
-    {
-        libusb_handle_events_timeout_completed(_context, &timeout, nullptr);
-    }
-
-    log_v("Canceling transfer requests");
-
-    for (Context &context : _transfers)
-    {
-        if (context.transfer)
-            libusb_cancel_transfer(context.transfer);
-        libusb_handle_events_timeout_completed(_context, &timeout, nullptr);
-    }
-
-    log_v("USB reading thread stopped");
+    std::lock_guard<std::mutex> lock(_infoMutex);
+    _phone = PhoneInfo();
+    _media = MediaInfo();
 }
 
 void Connection::processLoop()
@@ -355,28 +278,36 @@ void Connection::processLoop()
         if (!_processQueue.read(message->header(), message->headerSize(), _connected))
             break;
 
-        if (message->invalidMagic())
-        {
-            log_w("Header read failed > invalid magic");
-            _processQueue.discard();
-            continue;
-        }
-
-        if (message->invalidChecksum())
+        if (message->invalidMagic() || message->invalidChecksum() || message->invalidLength())
         {
-            log_w("Header read failed > invalid checksum");
-            _processQueue.discard();
-            continue;
+            log_w("Header read failed > invalid %s", message->invalidMagic() ? "magic" : (message->invalidChecksum() ? "checksum" : "length"));
+            if (!resync(*message))
+                break;
         }
 
-        if (message->invalidLength())
+        // Small payloads are cheaper to copy into the message than to hold the slot for
+        if (message->length() > MESSAGE_INLINE_SIZE && Settings::usbZeroCopy)
         {
-            log_w("Header read failed > invalid length");
-            _processQueue.discard();
-            continue;
+            uint32_t padding = message->type() == CMD_VIDEO_DATA ? AV_INPUT_BUFFER_PADDING_SIZE : 0;
+            uint32_t remain = message->length();
+            SlotSlice slice;
+            bool attached = true;
+            while (attached && remain > 0 && _processQueue.slice(slice, remain, _connected))
+            {
+                remain -= slice.length;
+                attached = message->attach(slice, padding);
+            }
+            if (!attached)
+            {
+                // Rest of the payload is skipped like the copy path does, next header starts right after it
+                _processQueue.read(nullptr, remain, _connected);
+                log_w("Message discarded > can't reference payload %d", message->length());
+                continue;
+            }
+            if (remain > 0)
+                continue;
         }
-
-        if (message->length() > 0)
+        else if (message->length() > 0)
         {
             uint32_t padding = message->type() == CMD_VIDEO_DATA ? AV_INPUT_BUFFER_PADDING_SIZE : 0;
             uint8_t *buff = message->allocate(padding);
@@ -395,79 +326,152 @@ void Connection::processLoop()
     log_v("USB processing thread stopped");
 }
 
-void Connection::writeLoop(libusb_device_handle *handler, uint8_t ep)
+void Connection::decryptLoop()
 {
-    while (_connected)
+    setThreadName("usb-decrypt");
+    log_d("USB decrypt thread started");
+
+    char error[256];
+    while (decryptStream.wait(_connected))
     {
-        std::unique_ptr<Message> message = writeQueue.pop();
+        std::unique_ptr<Message> message = decryptStream.pop();
         if (!message)
+            continue;
+
+        // Passing a dropped position means this frame may predict from missing ones
+        bool gap = false;
+        _decryptPopped++;
         {
-            if (!writeQueue.waitFor(_connected, PROTOCOL_HEARTBEAT_DELAY))
-                break;
-            message = writeQueue.pop();
+            std::lock_guard<std::mutex> lock(_gapMutex);
+            while (!_decryptGaps.empty() && _decryptGaps.front() < _decryptPopped)
+            {
+                _decryptGaps.pop_front();
+                gap = true;
+            }
         }
+        if (gap)
+            videoStream.lost();
 
-        if (!message)
-            message = Message::HeartBeat();
+        if (!message->decrypt(_decryptCipher.get(), error))
+        {
+            _stats[CMD_VIDEO_DATA].drops.fetch_add(1, std::memory_order_relaxed);
+            log_w("Can't decrypt message %d > %s", message->type(), error);
+            videoStream.lost();
+            continue;
+        }
+        dispatch(std::move(message));
+    }
 
-        if (!_connected)
-            break;
+    log_v("USB decrypt thread stopped");
+}
 
-        if (!message->allocated())
-            continue;
+bool Connection::resync(Message &message)
+{
+    uint8_t *header = message.header();
+    uint32_t size = message.headerSize();
+    uint32_t skipped = 0;
 
-        while (message->isMotion() && writeQueue.peek() && writeQueue.peek()->isMotion())
+    while (_connected)
+    {
+        // Header bytes are consumed already, next header can start inside them
+        int32_t offset = findHeader(header + 1, size - 1);
+        if (offset >= 0)
         {
-            message = writeQueue.pop();
+            uint32_t shift = offset + 1;
+            std::memmove(header, header + shift, size - shift);
+            skipped += shift;
+            if (!_processQueue.read(header + size - shift, shift, _connected))
+                return false;
         }
-
-        if (_ecnrypt)
+        else
         {
-            char error[256];
-            if (!message->encrypt(_cipher, error))
-            {
-                log_w("Message encryption failed > %s", error);
-                continue;
-            }
+            skipped += size;
+            if (!_processQueue.resync(skipped, _connected) || !_processQueue.read(header, size, _connected))
+                return false;
         }
 
-        int transferred;
-        int status = libusb_bulk_transfer(handler, ep, message->header(), message->headerSize(), &transferred, PROTOCOL_HEARTBEAT_DELAY);
-        message->setOffset(0);
-        if (status == LIBUSB_SUCCESS && message->length() > 0)
+        if (!message.invalidMagic() && !message.invalidChecksum() && !message.invalidLength())
         {
-            libusb_bulk_transfer(handler, ep, message->data(), message->length(), &transferred, PROTOCOL_HEARTBEAT_DELAY);
+            _resyncs.fetch_add(1, std::memory_order_relaxed);
+            _skipped.fetch_add(skipped, std::memory_order_relaxed);
+            log_w("Stream resynchronised > skipped %u bytes", skipped);
+            return true;
         }
     }
+    return false;
 }
 
-libusb_device *Connection::link(libusb_device_handle *handler, uint8_t *epIn, uint8_t *epOut)
+void Connection::writeLoop()
 {
-    if (fail(libusb_reset_device(handler), " Can't reset device"))
-        return nullptr;
+    while (_connected)
+    {
+        // Heartbeats come from the timer, so there is nothing to wake up for while the queue is empty
+        std::unique_ptr<Message> message = writeQueue.pop();
+        if (!message)
+        {
+            if (!writeQueue.wait(_connected))
+                break;
+            message = writeQueue.pop();
+        }
 
-    if (fail(libusb_set_configuration(handler, 1), "Can't set configuration"))
-        return nullptr;
+        if (!message)
+            continue;
 
-    if (fail(libusb_claim_interface(handler, 0), "Can't claim interface"))
-        return nullptr;
+        TransportWrite *write = _transport->acquireWrite(_connected, PROTOCOL_HEARTBEAT_DELAY);
+        if (!write)
+            break;
 
-    libusb_device *device = libusb_get_device(handler);
-    struct libusb_config_descriptor *config = nullptr;
-    if (fail(libusb_get_active_config_descriptor(device, &config), "Can't get config"))
-        return nullptr;
+        // Small messages already waiting in the queue go out in the same transfer
+        uint32_t batch = std::max(0, Settings::usbWriteBatch.value);
+        while (message)
+        {
+            if (!append(*write, *message))
+                _unsent.fetch_add(1, std::memory_order_relaxed);
+            message = write->length < batch ? writeQueue.pop(batch - write->length) : nullptr;
+        }
 
-    for (int i = 0; i < config->interface[0].altsetting[0].bNumEndpoints; i++)
-    {
-        const struct libusb_endpoint_descriptor *ep = &config->interface[0].altsetting[0].endpoint[i];
-        if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
-            *epIn = ep->bEndpointAddress;
+        if (write->length > 0)
+            _transport->submitWrite(*write);
         else
-            *epOut = ep->bEndpointAddress;
+            _transport->releaseWrite(*write);
+    }
+}
+
+bool Connection::append(TransportWrite &write, Message &message)
+{
+    if (!message.allocated())
+    {
+        log_w("Message discarded > payload is not allocated %d", message.length());
+        return false;
+    }
+
+    if (_ecnrypt)
+    {
+        char error[256];
+        if (!message.encrypt(_cipher, error))
+        {
+            log_w("Message encryption failed > %s", error);
+            return false;
+        }
     }
 
-    libusb_free_config_descriptor(config);
-    return device;
+    uint32_t size = message.wireSize();
+    if (write.length + size > write.capacity)
+    {
+        uint32_t capacity = std::max({write.length + size, write.capacity * 2, static_cast<uint32_t>(WRITE_BUFFER_SIZE)});
+        uint8_t *buffer = static_cast<uint8_t *>(realloc(write.buffer, capacity));
+        if (!buffer)
+        {
+            log_w("Message discarded > can't allocate write buffer %d", capacity);
+            return false;
+        }
+        write.buffer = buffer;
+        write.capacity = capacity;
+    }
+
+    message.serialize(write.buffer + write.length);
+    write.length += size;
+    return true;
 }
 
 void Connection::setEncryption(bool enabled)
@@ -485,14 +489,10 @@ void Connection::setEncryption(bool enabled)
 
     log_i("Encryption enabled");
     _ecnrypt = true;
-}
 
-bool Connection::fail(int status, const char *msg)
-{
-    if (status == 0)
-        return false;
-    log_w("%s > %s", msg, libusb_error_name(status));
-    return true;
+    // Called from processing thread, so video pushed before this point is already queued
+    if (Settings::decryptThread && _decryptCipher && !_decryptThread.joinable())
+        _decryptThread = std::thread(&Connection::decryptLoop, this);
 }
 
 void Connection::sendInit()
@@ -535,132 +535,261 @@ void Connection::sendInit()
 
     log_i("Requesting carplay %dx%d@%d, android auto %dx%d", Settings::width.value, Settings::height.value, Settings::sourceFps.value, width, height);
 
+    // Whole init sequence goes through one lane to keep its order
     if (Settings::encryption)
     {
         if (_cipher)
-            send(Message::Encryption(_cipher->seed()));
+            send(Message::Encryption(_cipher->seed()), WriteLane::Control);
         else
             log_w("Can't request encryption > Cypher is not initalised");
     }
 
     if (Settings::dpi > 0)
-        send(Message::File("/tmp/screen_dpi", Settings::dpi));
-    send(Message::File("/etc/android_work_mode", 1));
-    send(Message::Init(Settings::width, Settings::height, Settings::sourceFps));
+        send(Message::File("/tmp/screen_dpi", Settings::dpi), WriteLane::Control);
+    send(Message::File("/etc/android_work_mode", 1), WriteLane::Control);
+    send(Message::Init(Settings::width, Settings::height, Settings::sourceFps), WriteLane::Control);
     send(Message::String(
         CMD_JSON_CONTROL,
         "{\"syncTime\":%d,\"mediaDelay\":%d,\"drivePosition\":%d,"
         "\"androidAutoSizeW\":%d,\"androidAutoSizeH\":%d,\"HiCarConnectMode\":0,"
         "\"GNSSCapability\":7,\"DashboardInfo\":1,\"UseBTPhone\":0}",
-        syncTime, Settings::mediaDelay.value, drivePosition, width, height));
+        syncTime, Settings::mediaDelay.value, drivePosition, width, height), WriteLane::Control);
 
-    send(Message::String(CMD_DAYNIGHT, "{\"DayNightMode\":%d}", nightMode));
+    send(Message::String(CMD_DAYNIGHT, "{\"DayNightMode\":%d}", nightMode), WriteLane::Control);
 
-    send(Message::File("/tmp/night_mode", nightMode));
-    send(Message::File("/tmp/charge_mode", Settings::weakCharge ? 0 : 2)); // Weak charge 0, other 2
-    send(Message::File("/etc/box_name", "CarPlay"));
-    send(Message::File("/tmp/hand_drive_mode", drivePosition));
+    send(Message::File("/tmp/night_mode", nightMode), WriteLane::Control);
+    send(Message::File("/tmp/charge_mode", Settings::weakCharge ? 0 : 2), WriteLane::Control); // Weak charge 0, other 2
+    send(Message::File("/etc/box_name", "CarPlay"), WriteLane::Control);
+    send(Message::File("/tmp/hand_drive_mode", drivePosition), WriteLane::Control);
 
-    send(Message::Control(mic));
-    send(Message::Control(Settings::wifi5 ? 25 : 24));
-    send(Message::Control(Settings::bluetoothAudio ? 22 : 23));
+    send(Message::Control(mic), WriteLane::Control);
+    send(Message::Control(Settings::wifi5 ? 25 : 24), WriteLane::Control);
+    send(Message::Control(Settings::bluetoothAudio ? 22 : 23), WriteLane::Control);
     if (Settings::autoconnect)
-        send(Message::Control(1002));
+        send(Message::Control(1002), WriteLane::Control);
 }
 
 void Connection::onMessage(std::unique_ptr<Message> message)
 {
+    // Once decrypt stage is running all video goes through it to keep the frames in order,
+    // everything else is small and decrypted right here without waiting behind video
+    if (message->type() == CMD_VIDEO_DATA && _decryptThread.joinable())
+    {
+        if (decryptStream.pushDiscard(std::move(message)))
+        {
+            _decryptPushed++;
+            return;
+        }
+
+        // Decrypt stage handles the loss once it gets there, frames queued before are fine
+        _stats[CMD_VIDEO_DATA].drops.fetch_add(1, std::memory_order_relaxed);
+        log_w("Discard message > decrypt queue is full");
+        std::lock_guard<std::mutex> lock(_gapMutex);
+        if (_decryptGaps.empty() || _decryptGaps.back() != _decryptPushed)
+            _decryptGaps.push_back(_decryptPushed);
+        return;
+    }
+
     char error[256];
     if (!message->decrypt(_cipher, error))
     {
+        _stats[commandIndex(message->type())].drops.fetch_add(1, std::memory_order_relaxed);
         log_w("Can't decrypt message %d > %s", message->type(), error);
         return;
     }
 
-    if (message->type() == CMD_VIDEO_DATA && message->setOffset(20))
+    dispatch(std::move(message));
+}
+
+constexpr std::array<Connection::MessageHandler, PROTOCOL_CMD_COUNT> Connection::dispatchTable()
+{
+    std::array<MessageHandler, PROTOCOL_CMD_COUNT> table{};
+    for (MessageHandler &handler : table)
+        handler = &Connection::onUnknown;
+
+    table[CMD_VIDEO_DATA] = &Connection::onVideo;
+    table[CMD_AUDIO_DATA] = &Connection::onAudio;
+    table[CMD_CONTROL] = &Connection::onControl;
+    table[CMD_PLUGGED] = &Connection::onPlugged;
+    table[CMD_UNPLUGGED] = &Connection::onUnplugged;
+    table[CMD_ENCRYPTION] = &Connection::onEncryption;
+    table[CMD_JSON_CONTROL] = &Connection::onJsonControl;
+    table[CMD_MEDIA_INFO] = &Connection::onMediaInfo;
+    return table;
+}
+
+constexpr std::array<Connection::MessageHandler, PROTOCOL_CMD_COUNT> Connection::_dispatch = Connection::dispatchTable();
+
+bool Connection::subscribe(uint32_t type, MessageCallback callback)
+{
+    // Dispatch reads the lists without locking
+    if (_active)
     {
-        if (!videoStream.pushDiscard(std::move(message)))
-            log_w("Discard message > video queue is full");
-        return;
+        log_w("Can't subscribe to message %d > connection is running", type);
+        return false;
     }
 
-    if (message->type() == CMD_AUDIO_DATA && message->length() > 16)
+    _subscribers[commandIndex(type)].push_back(std::move(callback));
+    return true;
+}
+
+void Connection::dispatch(std::unique_ptr<Message> message)
+{
+    uint32_t index = commandIndex(message->type());
+    MessageStats &stats = _stats[index];
+    stats.messages.fetch_add(1, std::memory_order_relaxed);
+    stats.bytes.fetch_add(message->length(), std::memory_order_relaxed);
+
+    for (const MessageCallback &callback : _subscribers[index])
+        callback(*message);
+
+    if (!(this->*_dispatch[index])(message))
+        stats.drops.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool Connection::onVideo(std::unique_ptr<Message> &message)
+{
+    if (!message->setOffset(20))
+        return onUnknown(message);
+
+    if (_firstFrame.exchange(false, std::memory_order_relaxed))
+        log_i("First video frame %.0fms after device open", elapsedMs(_opened));
+
+    bool result = videoStream.push(std::move(message));
+    if (videoStream.keyframeNeeded())
+    {
+        log_i("Requesting keyframe");
+        send(Message::Control(BTN_SCREEN_REFRESH));
+    }
+    return result;
+}
+
+bool Connection::onAudio(std::unique_ptr<Message> &message)
+{
+    if (message->length() <= 16)
+        return onUnknown(message);
+
+    int channel = message->getInt(8);
+    if (channel == 1)
     {
-        int channel = message->getInt(8);
         message->setOffset(12);
-        if (channel == 1)
+        if (!audioStreamMain.pushDiscard(std::move(message)))
         {
-            if (!audioStreamMain.pushDiscard(std::move(message)))
-                log_w("Discard message > main audio queue is full");
-            return;
+            log_w("Discard message > main audio queue is full");
+            return false;
         }
-        if (channel == 2)
+        return true;
+    }
+    if (channel == 2)
+    {
+        message->setOffset(12);
+        if (!audioStreamAux.pushDiscard(std::move(message)))
         {
-            if (!audioStreamAux.pushDiscard(std::move(message)))
-                log_w("Discard message > aux audio queue is full");
-            return;
+            log_w("Discard message > aux audio queue is full");
+            return false;
         }
+        return true;
     }
 
-    if (message->type() == CMD_CONTROL && message->length() == 4)
+    return onUnknown(message);
+}
+
+bool Connection::onControl(std::unique_ptr<Message> &message)
+{
+    if (message->length() == 4)
     {
         switch (message->getInt(0))
         {
         case 1:
             _recorder.start(&writeQueue);
-            return;
+            return true;
 
         case 2:
-            _recorder.stop();
-            return;
+            _recorder.stop(&writeQueue);
+            return true;
         }
     }
+    return onUnknown(message);
+}
 
-    if (message->type() == CMD_PLUGGED)
-    {
-        onPhoneConnect();
-        return;
-    }
+bool Connection::onPlugged(std::unique_ptr<Message> &)
+{
+    onPhoneConnect();
+    return true;
+}
 
-    if (message->type() == CMD_UNPLUGGED)
-    {
-        onPhoneDisconnect();
-        return;
-    }
+bool Connection::onUnplugged(std::unique_ptr<Message> &)
+{
+    onPhoneDisconnect();
+    return true;
+}
+
+bool Connection::onEncryption(std::unique_ptr<Message> &message)
+{
+    if (message->length() != 0)
+        return onUnknown(message);
+
+    setEncryption(true);
+    return true;
+}
+
+bool Connection::onJsonControl(std::unique_ptr<Message> &message)
+{
+    log_d("Controll message %d [%d] > %s", message->type(), message->length(), ascii(message->data(), message->length()).c_str());
 
-    if (message->type() == CMD_ENCRYPTION && message->length() == 0)
+    PhoneInfo phone;
     {
-        setEncryption(true);
-        return;
+        std::lock_guard<std::mutex> lock(_infoMutex);
+        phone = _phone;
     }
+    if (!phone.update(message->data(), message->length()))
+        return onUnknown(message);
+
+    std::lock_guard<std::mutex> lock(_infoMutex);
+    _phone = phone;
+    return true;
+}
 
-    if (message->type() == CMD_JSON_CONTROL)
+bool Connection::onMediaInfo(std::unique_ptr<Message> &message)
+{
+    if (message->length() <= MEDIA_INFO_OFFSET || message->getInt(0) != MEDIA_INFO_JSON)
+        return onUnknown(message);
+
+    MediaInfo previous;
     {
-        char buf[64];
-        log_d("Controll message %d [%d] > %s", message->type(), message->length(), ascii(message->data(), message->length()).c_str());
-        if (jsonFindString(message->data(), message->length(), "MDLinkType", buf, 64))
-            _method = buf;
-        if (jsonFindString(message->data(), message->length(), "btName", buf, 64))
-            _phoneName = buf;
-        return;
+        std::lock_guard<std::mutex> lock(_infoMutex);
+        previous = _media;
     }
+    MediaInfo media = previous;
+    if (!media.update(message->data() + MEDIA_INFO_OFFSET, message->length() - MEDIA_INFO_OFFSET))
+        return onUnknown(message);
 
+    if (std::strcmp(media.song, previous.song) != 0 || std::strcmp(media.artist, previous.artist) != 0)
+        log_i("Now playing %s - %s", media.artist, media.song);
+
+    std::lock_guard<std::mutex> lock(_infoMutex);
+    _media = media;
+    return true;
+}
+
+bool Connection::onUnknown(std::unique_ptr<Message> &message)
+{
     log_v("Unknown message %d [%d] > %s", message->type(), message->length(), bytes(message->data(), message->length(), 40).c_str());
+    return true;
 }
 
 const std::string Connection::status() const
 {
     std::ostringstream out;
 
-    const libusb_version *version = libusb_get_version();
-    out << "v"
-        << static_cast<int>(version->major) << '.'
-        << static_cast<int>(version->minor) << '.'
-        << static_cast<int>(version->micro) << '.'
-        << static_cast<int>(version->nano) << " "
-        << " queue " << _processQueue.count() << " / " << Settings::usbBuffer << " "
+    out << _transport->status() << " "
+        << "queue " << _processQueue.count() << " / " << Settings::usbBuffer << " "
+        << "decrypt " << decryptStream.count() << " / " << DECRYPT_QUEUE_SIZE << " "
+        << "drop " << _stats[CMD_VIDEO_DATA].drops.load(std::memory_order_relaxed) << " / " << _stats[CMD_AUDIO_DATA].drops.load(std::memory_order_relaxed) << " "
+        << "resync " << _resyncs.load(std::memory_order_relaxed) << " / " << _skipped.load(std::memory_order_relaxed) << " "
+        << "unsent " << _unsent.load(std::memory_order_relaxed) << " "
         << (_ecnrypt.load(std::memory_order_acquire) ? "encrypt" : "simple") << " "
-        << _phoneName << " via " << _method;
+        << phoneName() << " via " << connectionMethod();
 
     return out.str();
 }
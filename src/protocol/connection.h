@@ -1,86 +1,144 @@
 #ifndef SRC_PROTOCOL_CONNECTION
 #define SRC_PROTOCOL_CONNECTION
 
-#include <libusb-1.0/libusb.h>
-
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "common/timer_wheel.h"
 #include "struct/atomic_queue.h"
 #include "protocol/aes_cipher.h"
+#include "protocol/capture.h"
+#include "protocol/phone_info.h"
+#include "protocol/transport.h"
 #include "protocol/usb_buffer.h"
+#include "protocol/video_queue.h"
+#include "protocol/write_queue.h"
 #include "recorder.h"
 
 #define LINK_RETRY 3
 #define CONNECT_RETRY 20
 #define LINK_RETRY_TIMEOUT 100
 #define RECONNECT_TIMEOUT 200
-#define PROTOCOL_HEARTBEAT_DELAY 3000
 
-#define WRITE_QUEUE_SIZE 128
+#define WRITE_BUFFER_SIZE 4096
 #define VIDEO_QUEUE_SIZE 128
 #define AUDIO_QUEUE_SIZE 128
 #define PROCESS_QUEUE_SIZE 128
+#define DECRYPT_QUEUE_SIZE 64
 
-#define ENCRYPTION_BASE "SkBRDy3gmrw1ieH0"
+// Per command counters, drops are messages that were received but could not be delivered
+struct MessageStats
+{
+    std::atomic<uint64_t> messages{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> drops{0};
+};
+
+// Called on receiving thread before the message is handled, must not block
+using MessageCallback = std::function<void(const Message &message)>;
 
 class Connection
 {
 
 public:
-    Connection();
+    // Device is the usb port path this session is bound to, empty takes any dongle
+    Connection(Recorder &recorder, const std::string &device = "");
     virtual ~Connection();
 
     void start();
     void stop();
 
-    bool inline send(std::unique_ptr<Message> message) { return writeQueue.pushDiscard(std::move(message)); }
-    uint32_t transfered() const { return _transfered.load(std::memory_order_acquire); }
+    bool inline send(std::unique_ptr<Message> message) { return writeQueue.push(std::move(message)); }
+    bool inline send(std::unique_ptr<Message> message, WriteLane lane) { return writeQueue.push(std::move(message), lane); }
+    uint32_t transfered() const { return _transport->transfered(); }
 
+    const std::string &device() const { return _device; }
     int8_t state() const { return _state.load(); }
-    std::string connectionMethod() const { return _method; }
-    std::string phoneName() const { return _phoneName; }
+    std::string connectionMethod() const { return phoneInfo().linkType; }
+    std::string phoneName() const { return phoneInfo().name; }
+    PhoneInfo phoneInfo() const
+    {
+        std::lock_guard<std::mutex> lock(_infoMutex);
+        return _phone;
+    }
+    MediaInfo mediaInfo() const
+    {
+        std::lock_guard<std::mutex> lock(_infoMutex);
+        return _media;
+    }
     const std::string status() const;
 
-    AtomicQueue<Message> writeQueue;
-    AtomicQueue<Message> videoStream;
+    // Subscribers can only be added while connection is stopped
+    bool subscribe(uint32_t type, MessageCallback callback);
+    const MessageStats &stats(uint32_t type) const { return _stats[commandIndex(type)]; }
+
+    WriteQueue writeQueue;
+    VideoQueue videoStream;
     AtomicQueue<Message> audioStreamMain;
     AtomicQueue<Message> audioStreamAux;
+    AtomicQueue<Message> decryptStream;
 
 private:
-    struct Context
-    {
-        Connection *owner = nullptr;
-        DataSlot *slot = nullptr;
-        libusb_transfer *transfer = nullptr;
-    };
-
-    static void onTransfer(libusb_transfer *transfer);
     void mainLoop();
-    void readLoop();
     void processLoop();
-    void writeLoop(libusb_device_handle *handler, uint8_t ep);
-    libusb_device *link(libusb_device_handle *handler, uint8_t *epIn, uint8_t *epOut);
+    void decryptLoop();
+    bool resync(Message &message);
+    void writeLoop();
+    bool append(TransportWrite &write, Message &message);
     void setEncryption(bool enabled);
-    bool fail(int status, const char *msg);
     void sendInit();
-    void onDeviceConnect(libusb_device_handle *handler, libusb_device *device, uint8_t endpointIn);
+    void onDeviceConnect();
     void onDeviceDisconnect();
     void onPhoneConnect();
     void onPhoneDisconnect();
     void onMessage(std::unique_ptr<Message> message);
+    void dispatch(std::unique_ptr<Message> message);
+
+    // Handlers return false when message is dropped
+    using MessageHandler = bool (Connection::*)(std::unique_ptr<Message> &message);
+    static constexpr std::array<MessageHandler, PROTOCOL_CMD_COUNT> dispatchTable();
+    static const std::array<MessageHandler, PROTOCOL_CMD_COUNT> _dispatch;
+    static uint32_t commandIndex(uint32_t type) { return type < PROTOCOL_CMD_COUNT ? type : 0; }
+    static double elapsedMs(std::chrono::steady_clock::time_point from)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - from).count();
+    }
+
+    bool onVideo(std::unique_ptr<Message> &message);
+    bool onAudio(std::unique_ptr<Message> &message);
+    bool onControl(std::unique_ptr<Message> &message);
+    bool onPlugged(std::unique_ptr<Message> &message);
+    bool onUnplugged(std::unique_ptr<Message> &message);
+    bool onEncryption(std::unique_ptr<Message> &message);
+    bool onJsonControl(std::unique_ptr<Message> &message);
+    bool onMediaInfo(std::unique_ptr<Message> &message);
+    bool onUnknown(std::unique_ptr<Message> &message);
 
     std::thread _writeThread;
-    std::thread _readThread;
     std::thread _processThread;
+    std::thread _decryptThread;
 
-    Recorder _recorder;
+    std::string _device;
+    Recorder &_recorder;
+    CaptureWriter _capture;
     UsbBuffer _processQueue;
-    std::vector<Context> _transfers;
+    std::unique_ptr<Transport> _transport;
     atomic<int8_t> *_statusHandler;
     AESCipher *_cipher;
-    libusb_context *_context;
+    std::unique_ptr<AESCipher> _decryptCipher;
+    // Positions in decrypt stream where video was dropped, counted in pushed messages
+    std::mutex _gapMutex;
+    std::deque<uint64_t> _decryptGaps;
+    uint64_t _decryptPushed;
+    uint64_t _decryptPopped;
 
     std::atomic<bool> _active;
     std::atomic<bool> _connected;
@@ -88,9 +146,18 @@ private:
     std::atomic<bool> _ecnrypt;
     std::atomic<int8_t> _state;
 
-    std::string _method;
-    std::string _phoneName;
-    std::atomic<uint32_t> _transfered;
+    PhoneInfo _phone;
+    MediaInfo _media;
+    mutable std::mutex _infoMutex;
+    std::atomic<uint32_t> _resyncs;
+    std::atomic<uint32_t> _skipped;
+    std::atomic<uint32_t> _unsent; // Taken from write queue but could not be put into a transfer
+    std::chrono::steady_clock::time_point _opened;
+    std::atomic<bool> _firstFrame;
+    TimerWheel::Id _heartbeat;
+
+    std::array<MessageStats, PROTOCOL_CMD_COUNT> _stats;
+    std::array<std::vector<MessageCallback>, PROTOCOL_CMD_COUNT> _subscribers;
 };
 
 #endif /* SRC_PROTOCOL_CONNECTION */
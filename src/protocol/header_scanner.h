@@ -0,0 +1,107 @@
+#ifndef SRC_PROTOCOL_HEADER_SCANNER
+#define SRC_PROTOCOL_HEADER_SCANNER
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "protocol/message.h"
+#include "protocol/protocol_const.h"
+
+// Both magics are XX 55 XX 55 in memory with XX being aa or bb
+#define HEADER_MAGIC_HIGH 0x55
+#define HEADER_MAGIC_LOW 0xaa
+#define HEADER_MAGIC_LOW_ENC 0xbb
+
+// Can a header start at data[index], bytes past the end are treated as not received yet
+inline bool headerCandidate(const uint8_t *data, uint32_t length, uint32_t index)
+{
+    uint32_t available = length - index;
+    uint8_t first = data[index];
+    if (first != HEADER_MAGIC_LOW && first != HEADER_MAGIC_LOW_ENC)
+        return false;
+
+    const uint8_t magic[4] = {first, HEADER_MAGIC_HIGH, first, HEADER_MAGIC_HIGH};
+    for (uint32_t i = 1; i < 4 && i < available; i++)
+    {
+        if (data[index + i] != magic[i])
+            return false;
+    }
+
+    if (available < sizeof(Header))
+        return true;
+
+    Header header;
+    std::memcpy(&header, data + index, sizeof(Header));
+    return header.typecheck == ~header.type && header.length >= 0 && header.length <= MESSAGE_MAX_PAYLOAD_SIZE;
+}
+
+// Offset of the first position where a valid header starts or may start once more data arrives, -1 if none
+inline int32_t findHeader(const uint8_t *data, uint32_t length)
+{
+    uint32_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i high = _mm_set1_epi8(static_cast<char>(HEADER_MAGIC_HIGH));
+    const __m128i low = _mm_set1_epi8(static_cast<char>(HEADER_MAGIC_LOW));
+    const __m128i lowEnc = _mm_set1_epi8(static_cast<char>(HEADER_MAGIC_LOW_ENC));
+    // 16 positions at once, each one needs 4 magic bytes
+    for (; i + 19 <= length; i += 16)
+    {
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1));
+        __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 2));
+        __m128i b3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 3));
+        __m128i match = _mm_and_si128(_mm_cmpeq_epi8(b1, high), _mm_cmpeq_epi8(b3, high));
+        match = _mm_and_si128(match, _mm_cmpeq_epi8(b0, b2));
+        match = _mm_and_si128(match, _mm_or_si128(_mm_cmpeq_epi8(b0, low), _mm_cmpeq_epi8(b0, lowEnc)));
+
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(match));
+        while (mask)
+        {
+            uint32_t index = i + __builtin_ctz(mask);
+            if (headerCandidate(data, length, index))
+                return index;
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t high = vdupq_n_u8(HEADER_MAGIC_HIGH);
+    const uint8x16_t low = vdupq_n_u8(HEADER_MAGIC_LOW);
+    const uint8x16_t lowEnc = vdupq_n_u8(HEADER_MAGIC_LOW_ENC);
+    for (; i + 19 <= length; i += 16)
+    {
+        uint8x16_t b0 = vld1q_u8(data + i);
+        uint8x16_t b1 = vld1q_u8(data + i + 1);
+        uint8x16_t b2 = vld1q_u8(data + i + 2);
+        uint8x16_t b3 = vld1q_u8(data + i + 3);
+        uint8x16_t match = vandq_u8(vceqq_u8(b1, high), vceqq_u8(b3, high));
+        match = vandq_u8(match, vceqq_u8(b0, b2));
+        match = vandq_u8(match, vorrq_u8(vceqq_u8(b0, low), vceqq_u8(b0, lowEnc)));
+
+        // Narrow to 4 bits per position
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+        while (mask)
+        {
+            uint32_t index = i + (__builtin_ctzll(mask) >> 2);
+            if (headerCandidate(data, length, index))
+                return index;
+            mask &= ~(0xfull << (__builtin_ctzll(mask) & ~3u));
+        }
+    }
+#endif
+
+    for (; i < length; i++)
+    {
+        if ((data[i] == HEADER_MAGIC_LOW || data[i] == HEADER_MAGIC_LOW_ENC) && headerCandidate(data, length, i))
+            return i;
+    }
+    return -1;
+}
+
+#endif /* SRC_PROTOCOL_HEADER_SCANNER */
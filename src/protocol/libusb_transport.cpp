@@ -0,0 +1,479 @@
+#include "protocol/libusb_transport.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "common/functions.h"
+#include "common/logger.h"
+#include "protocol/protocol_const.h"
+#include "settings.h"
+
+LibusbTransport::LibusbTransport(UsbBuffer &buffer, const std::string &path)
+    : Transport(buffer),
+      _usb(UsbContext::acquire()),
+      _path(path),
+      _transfers(UsbTuner::maxDepth()),
+      _inFlight(0),
+      _exhausted(0),
+      _started(false),
+      _cancelled(false),
+      _drained(true),
+      _handler(nullptr),
+      _device(nullptr),
+      _endpointIn(0),
+      _endpointOut(0),
+      _connected(nullptr),
+      _hotplugUsable(Settings::usbHotplug && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)),
+      _hotplug(false),
+      _hotplugHandle(0),
+      _arrived(false)
+{
+    for (Context &context : _transfers)
+    {
+        context.owner = this;
+        context.transfer = libusb_alloc_transfer(0);
+        if (!context.transfer)
+            throw std::runtime_error("Can't allocate usb transfer");
+    }
+
+    for (TransportWrite &write : _writes)
+    {
+        libusb_transfer *transfer = libusb_alloc_transfer(0);
+        if (!transfer)
+            throw std::runtime_error("Can't allocate usb transfer");
+        write.handle = transfer;
+    }
+}
+
+LibusbTransport::~LibusbTransport()
+{
+    close();
+
+    for (Context &context : _transfers)
+    {
+        if (context.transfer)
+        {
+            libusb_free_transfer(context.transfer);
+            context.transfer = nullptr;
+        }
+    }
+
+    for (TransportWrite &write : _writes)
+    {
+        if (write.handle)
+        {
+            libusb_free_transfer(static_cast<libusb_transfer *>(write.handle));
+            write.handle = nullptr;
+        }
+    }
+}
+
+bool LibusbTransport::open()
+{
+    _arrived = false;
+    // Registered before looking, so a dongle showing up right after a failed open is not missed
+    watch();
+    if (_path.empty())
+    {
+        _handler = libusb_open_device_with_vid_pid(_usb->context(), Settings::vendorid, Settings::productid);
+        return _handler != nullptr;
+    }
+
+    libusb_device **list = nullptr;
+    ssize_t count = libusb_get_device_list(_usb->context(), &list);
+    if (count < 0)
+        return false;
+
+    for (ssize_t i = 0; i < count && !_handler; i++)
+    {
+        libusb_device_descriptor descriptor{};
+        if (libusb_get_device_descriptor(list[i], &descriptor) != LIBUSB_SUCCESS ||
+            descriptor.idVendor != Settings::vendorid || descriptor.idProduct != Settings::productid ||
+            UsbContext::devicePath(list[i]) != _path)
+            continue;
+
+        int status = libusb_open(list[i], &_handler);
+        if (status != LIBUSB_SUCCESS)
+        {
+            log_w("Can't open usb device %s > %s", _path.c_str(), libusb_error_name(status));
+            _handler = nullptr;
+        }
+    }
+
+    libusb_free_device_list(list, 1);
+    return _handler != nullptr;
+}
+
+int LIBUSB_CALL LibusbTransport::onHotplug(libusb_context *, libusb_device *device, libusb_hotplug_event, void *userData)
+{
+    LibusbTransport *owner = static_cast<LibusbTransport *>(userData);
+    if (owner->_path.empty() || UsbContext::devicePath(device) == owner->_path)
+    {
+        owner->_arrived = true;
+        owner->_arrival.notify();
+    }
+    return 0;
+}
+
+bool LibusbTransport::waitDevice(std::atomic<bool> &active, uint32_t timeoutMs)
+{
+    watch();
+    if (!_hotplug)
+        return false;
+
+    // Hotplug callback comes from usb event thread, short slices keep stop responsive
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (active && !_arrived && std::chrono::steady_clock::now() < deadline)
+        _arrival.wait([this]()
+                      { return _arrived.load(); },
+                      active, USB_HOTPLUG_SLICE);
+
+    if (_arrived)
+        log_d("USB device arrived");
+    return true;
+}
+
+void LibusbTransport::watch()
+{
+    if (_hotplug || !_hotplugUsable)
+        return;
+
+    int result = libusb_hotplug_register_callback(_usb->context(), LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                                                  Settings::vendorid, Settings::productid, LIBUSB_HOTPLUG_MATCH_ANY,
+                                                  LibusbTransport::onHotplug, this, &_hotplugHandle);
+    _hotplug = result == LIBUSB_SUCCESS;
+    if (!_hotplug)
+    {
+        log_w("Can't register usb hotplug callback > %s, polling for device", libusb_error_name(result));
+        _hotplugUsable = false;
+    }
+}
+
+void LibusbTransport::unwatch()
+{
+    if (!_hotplug)
+        return;
+
+    // Callback may be running on event thread right now, detach returns once that round is over
+    libusb_hotplug_deregister_callback(_usb->context(), _hotplugHandle);
+    _hotplug = false;
+    _usb->detach(this);
+}
+
+bool LibusbTransport::claim()
+{
+    return libusb_set_configuration(_handler, 1) == LIBUSB_SUCCESS && libusb_claim_interface(_handler, 0) == LIBUSB_SUCCESS;
+}
+
+bool LibusbTransport::link()
+{
+    _device = nullptr;
+
+    auto begin = std::chrono::steady_clock::now();
+    auto elapsed = [](std::chrono::steady_clock::time_point &from)
+    {
+        auto now = std::chrono::steady_clock::now();
+        double result = std::chrono::duration<double, std::milli>(now - from).count();
+        from = now;
+        return result;
+    };
+    auto phase = begin;
+
+    // Freshly enumerated dongle is claimed right away, reset only recovers it from a stale session
+    bool reset = Settings::usbForceReset || !claim();
+    double claimTime = elapsed(phase);
+    double resetTime = 0;
+    if (reset)
+    {
+        libusb_release_interface(_handler, 0);
+        if (fail(libusb_reset_device(_handler), " Can't reset device"))
+            return false;
+        resetTime = elapsed(phase);
+
+        if (fail(libusb_set_configuration(_handler, 1), "Can't set configuration"))
+            return false;
+
+        if (fail(libusb_claim_interface(_handler, 0), "Can't claim interface"))
+            return false;
+        claimTime += elapsed(phase);
+    }
+
+    libusb_device *device = libusb_get_device(_handler);
+    struct libusb_config_descriptor *config = nullptr;
+    if (fail(libusb_get_active_config_descriptor(device, &config), "Can't get config"))
+        return false;
+
+    for (int i = 0; i < config->interface[0].altsetting[0].bNumEndpoints; i++)
+    {
+        const struct libusb_endpoint_descriptor *ep = &config->interface[0].altsetting[0].endpoint[i];
+        if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+            _endpointIn = ep->bEndpointAddress;
+        else
+            _endpointOut = ep->bEndpointAddress;
+    }
+
+    libusb_free_config_descriptor(config);
+    _device = device;
+
+    double endpointTime = elapsed(phase);
+    log_i("USB linked in %.1fms > claim %.1fms, reset %s %.1fms, endpoints %.1fms",
+          std::chrono::duration<double, std::milli>(phase - begin).count(), claimTime, reset ? "done" : "skipped", resetTime, endpointTime);
+    return true;
+}
+
+bool LibusbTransport::start(std::atomic<bool> &connected)
+{
+    _connected = &connected;
+    log_i("Device connected %s address %d speed: %d", UsbContext::devicePath(_device).c_str(), libusb_get_device_address(_device), libusb_get_device_speed(_device));
+
+    _tuner.reset();
+    _inFlight = 0;
+    _exhausted = 0;
+    _started = false;
+    _cancelled = false;
+    _drained = false;
+
+    for (Context &context : _transfers)
+    {
+        context.slot = nullptr;
+        context.active = false;
+        libusb_fill_bulk_transfer(context.transfer, _handler, _endpointIn, nullptr, 0, LibusbTransport::onTransfer, &context, 0);
+    }
+
+    for (TransportWrite &write : _writes)
+    {
+        write.busy = false;
+        libusb_fill_bulk_transfer(static_cast<libusb_transfer *>(write.handle), _handler, _endpointOut, write.buffer, 0, LibusbTransport::onWriteTransfer, &write, PROTOCOL_HEARTBEAT_DELAY);
+    }
+
+    // Even initial transfers are submitted from event thread, callbacks of other devices run there
+    // already, so taking slots here would make a second producer for the usb buffer
+    _usb->attach(this);
+    return connected;
+}
+
+void LibusbTransport::stop()
+{
+    // Event thread cancels reads once connected flag is cleared and wakes us when all are returned
+    std::atomic<bool> waiting(true);
+    _drain.wait([this]()
+                { return _drained.load(); },
+                waiting, PROTOCOL_HEARTBEAT_DELAY);
+    if (!_drained)
+        log_w("USB read transfers are still pending after disconnect");
+
+    _usb->detach(this);
+    cancelWrites();
+}
+
+void LibusbTransport::close()
+{
+    unwatch();
+    if (!_handler)
+        return;
+
+    libusb_release_interface(_handler, 0);
+    libusb_close(_handler);
+    _handler = nullptr;
+    _device = nullptr;
+}
+
+void LibusbTransport::onTransfer(libusb_transfer *transfer)
+{
+    if (!transfer || !transfer->user_data)
+        return;
+
+    Context *c = static_cast<Context *>(transfer->user_data);
+    LibusbTransport *owner = c->owner;
+    if (!*owner->_connected || transfer->status == LIBUSB_TRANSFER_CANCELLED)
+    {
+        owner->park(*c);
+        return;
+    }
+
+    owner->_transfered.fetch_add(transfer->actual_length, std::memory_order_relaxed);
+    log_p("Transfer %d [%d] > %s", transfer->actual_length, transfer->status, bytes(transfer->buffer, transfer->actual_length, 40).c_str());
+
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+    {
+        *owner->_connected = false;
+        owner->park(*c);
+        return;
+    }
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    {
+        uint32_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - c->submitted).count();
+        owner->_tuner.completed(transfer->actual_length, transfer->length, latency);
+        if (owner->_capture)
+            owner->_capture->capture(CAPTURE_INBOUND, transfer->buffer, transfer->actual_length);
+        c->slot->commit(transfer->actual_length);
+        c->slot = nullptr;
+
+        // Transfer is parked when tuner wants less of them in flight or processing is behind,
+        // event thread resumes it once there is a free slot
+        if (owner->_inFlight > owner->_tuner.depth())
+        {
+            owner->park(*c);
+            return;
+        }
+
+        c->slot = owner->_buffer.get();
+        if (!c->slot)
+        {
+            if (owner->_exhausted.fetch_add(1, std::memory_order_relaxed) == 0)
+                log_w("USB data slots exhausted, pausing usb transfers until processing catches up");
+            owner->_tuner.exhausted();
+            owner->park(*c);
+            return;
+        }
+    }
+
+    owner->submit(*c);
+}
+
+bool LibusbTransport::submit(Context &context)
+{
+    context.transfer->buffer = context.slot->data;
+    context.transfer->length = std::min<uint32_t>(_tuner.size(), context.slot->size);
+    context.submitted = std::chrono::steady_clock::now();
+
+    int status = libusb_submit_transfer(context.transfer);
+    if (status != LIBUSB_SUCCESS)
+    {
+        log_w("USB transfer submit failed with status %d", status);
+        *_connected = false;
+        park(context);
+        return false;
+    }
+
+    if (!context.active)
+    {
+        context.active = true;
+        _inFlight++;
+    }
+    return true;
+}
+
+void LibusbTransport::park(Context &context)
+{
+    if (!context.active)
+        return;
+    context.active = false;
+    _inFlight--;
+}
+
+void LibusbTransport::resumeTransfers()
+{
+    for (Context &context : _transfers)
+    {
+        if (!*_connected || _inFlight >= _tuner.depth())
+            return;
+        if (context.active)
+            continue;
+
+        context.slot = _buffer.get();
+        if (!context.slot || !submit(context))
+            return;
+    }
+}
+
+void LibusbTransport::poll()
+{
+    if (*_connected)
+    {
+        resumeTransfers();
+        if (!_started && _inFlight < _tuner.depth())
+            log_w("Only %d of %d usb transfers submitted, increase usb buffer slots", _inFlight, _tuner.depth());
+        _started = true;
+        return;
+    }
+
+    if (!_cancelled)
+    {
+        log_v("Canceling transfer requests");
+        for (Context &context : _transfers)
+        {
+            if (context.active)
+                libusb_cancel_transfer(context.transfer);
+        }
+        _cancelled = true;
+    }
+
+    if (_inFlight == 0 && !_drained)
+    {
+        _drained = true;
+        _drain.notify();
+    }
+}
+
+bool LibusbTransport::submit(TransportWrite &write)
+{
+    libusb_transfer *transfer = static_cast<libusb_transfer *>(write.handle);
+    transfer->buffer = write.buffer;
+    transfer->length = write.length;
+
+    int status = libusb_submit_transfer(transfer);
+    if (status != LIBUSB_SUCCESS)
+    {
+        log_w("USB write submit failed with status %d", status);
+        if (status == LIBUSB_ERROR_NO_DEVICE)
+            *_connected = false;
+        return false;
+    }
+    return true;
+}
+
+void LibusbTransport::onWriteTransfer(libusb_transfer *transfer)
+{
+    if (!transfer || !transfer->user_data)
+        return;
+
+    TransportWrite *write = static_cast<TransportWrite *>(transfer->user_data);
+    LibusbTransport *owner = static_cast<LibusbTransport *>(write->owner);
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+        *owner->_connected = false;
+    else if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+        log_w("USB write failed with status %d", transfer->status);
+
+    owner->complete(*write);
+}
+
+void LibusbTransport::cancelWrites()
+{
+    for (TransportWrite &write : _writes)
+    {
+        if (write.busy)
+            libusb_cancel_transfer(static_cast<libusb_transfer *>(write.handle));
+    }
+
+    // Cancelled writes complete on event thread, wait for them before transfers are reused
+    if (!waitWrites(PROTOCOL_HEARTBEAT_DELAY))
+        log_w("USB write transfers are still pending after disconnect");
+}
+
+bool LibusbTransport::fail(int status, const char *msg)
+{
+    if (status == 0)
+        return false;
+    log_w("%s > %s", msg, libusb_error_name(status));
+    return true;
+}
+
+std::string LibusbTransport::status() const
+{
+    std::ostringstream out;
+
+    const libusb_version *version = libusb_get_version();
+    out << "v"
+        << static_cast<int>(version->major) << '.'
+        << static_cast<int>(version->minor) << '.'
+        << static_cast<int>(version->micro) << '.'
+        << static_cast<int>(version->nano) << " "
+        << (_path.empty() ? "any" : _path) << " "
+        << "usb " << _tuner.depth() << " x " << _tuner.size() << " "
+        << "exhausted " << _exhausted.load(std::memory_order_relaxed);
+
+    return out.str();
+}
@@ -0,0 +1,88 @@
+#ifndef SRC_PROTOCOL_LIBUSB_TRANSPORT
+#define SRC_PROTOCOL_LIBUSB_TRANSPORT
+
+#include <libusb-1.0/libusb.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/adaptive_waiter.h"
+#include "protocol/transport.h"
+#include "protocol/usb_context.h"
+#include "protocol/usb_tuner.h"
+
+#define USB_HOTPLUG_SLICE 20 // ms, wait step while waiting for the dongle
+
+// Dongle connected over usb, reads are kept in flight as async bulk transfers.
+// Transfer callbacks run on the shared usb event thread, which is the only producer of the usb buffer.
+class LibusbTransport : public Transport, private UsbPoller
+{
+public:
+    // Empty path takes the first dongle with configured vendor and product id
+    LibusbTransport(UsbBuffer &buffer, const std::string &path);
+    ~LibusbTransport() override;
+
+    bool open() override;
+    bool waitDevice(std::atomic<bool> &active, uint32_t timeoutMs) override;
+    bool link() override;
+    bool start(std::atomic<bool> &connected) override;
+    void stop() override;
+    void close() override;
+
+    const char *name() const override { return "usb"; }
+    std::string status() const override;
+
+protected:
+    bool submit(TransportWrite &write) override;
+
+private:
+    struct Context
+    {
+        LibusbTransport *owner = nullptr;
+        DataSlot *slot = nullptr;
+        libusb_transfer *transfer = nullptr;
+        bool active = false;
+        std::chrono::steady_clock::time_point submitted;
+    };
+
+    static int LIBUSB_CALL onHotplug(libusb_context *context, libusb_device *device, libusb_hotplug_event event, void *userData);
+    static void onTransfer(libusb_transfer *transfer);
+    static void onWriteTransfer(libusb_transfer *transfer);
+    void poll() override;
+    bool submit(Context &context);
+    void park(Context &context);
+    void resumeTransfers();
+    void cancelWrites();
+    void watch();
+    void unwatch();
+    bool fail(int status, const char *msg);
+    bool claim();
+
+    std::shared_ptr<UsbContext> _usb;
+    std::string _path;
+    std::vector<Context> _transfers;
+    UsbTuner _tuner;
+    uint16_t _inFlight;
+    std::atomic<uint32_t> _exhausted;
+    bool _started;
+    bool _cancelled;
+    std::atomic<bool> _drained;
+    AdaptiveWaiter _drain;
+
+    libusb_device_handle *_handler;
+    libusb_device *_device;
+    uint8_t _endpointIn;
+    uint8_t _endpointOut;
+    std::atomic<bool> *_connected;
+
+    bool _hotplugUsable;
+    bool _hotplug; // Callback is registered
+    libusb_hotplug_callback_handle _hotplugHandle;
+    std::atomic<bool> _arrived;
+    AdaptiveWaiter _arrival;
+};
+
+#endif /* SRC_PROTOCOL_LIBUSB_TRANSPORT */
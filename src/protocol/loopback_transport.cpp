@@ -0,0 +1,119 @@
+#include "protocol/loopback_transport.h"
+
+#include <cstring>
+#include <sstream>
+
+#include "common/logger.h"
+#include "protocol/message.h"
+#include "protocol/protocol_const.h"
+
+#define LOOPBACK_PHONE_TYPE 3 // CarPlay
+#define LOOPBACK_PHONE_INFO "{\"MDLinkType\":\"CarPlay\",\"btName\":\"Loopback\"}"
+
+LoopbackTransport::LoopbackTransport(UsbBuffer &buffer)
+    : Transport(buffer),
+      _connected(nullptr),
+      _received(0)
+{
+}
+
+bool LoopbackTransport::start(std::atomic<bool> &connected)
+{
+    _connected = &connected;
+    _cipher.reset();
+    log_i("Loopback dongle connected");
+    return true;
+}
+
+bool LoopbackTransport::submit(TransportWrite &write)
+{
+    // Writes are answered right away on the writing thread, so it is the only producer of the usb buffer
+    uint32_t offset = 0;
+    while (offset + sizeof(Header) <= write.length)
+    {
+        Header header;
+        std::memcpy(&header, write.buffer + offset, sizeof(Header));
+        offset += sizeof(Header);
+
+        uint32_t length = header.length > 0 ? static_cast<uint32_t>(header.length) : 0;
+        if ((header.magic != MAGIC && header.magic != MAGIC_ENC) || offset + length > write.length)
+        {
+            log_w("Loopback received malformed message");
+            break;
+        }
+
+        _payload.assign(write.buffer + offset, write.buffer + offset + length);
+        offset += length;
+
+        char error[256];
+        if (header.magic == MAGIC_ENC && (!_cipher || !_cipher->decrypt(_payload.data(), length, error)))
+        {
+            log_w("Loopback can't decrypt message %d", header.type);
+            continue;
+        }
+
+        _received.fetch_add(1, std::memory_order_relaxed);
+        answer(header.type, _payload.data(), length);
+    }
+
+    complete(write);
+    return true;
+}
+
+void LoopbackTransport::answer(uint32_t type, const uint8_t *payload, uint32_t length)
+{
+    switch (type)
+    {
+    case CMD_ENCRYPTION:
+    {
+        if (length != 4)
+            return;
+        uint32_t seed;
+        std::memcpy(&seed, payload, sizeof(seed));
+        // Confirmation goes in plain, everything after it is encrypted
+        reply(CMD_ENCRYPTION);
+        _cipher = std::make_unique<AESCipher>(ENCRYPTION_BASE, seed);
+        return;
+    }
+
+    case CMD_OPEN:
+    {
+        reply(CMD_OPEN, payload, length);
+        uint8_t phone[4];
+        uint32_t phoneType = LOOPBACK_PHONE_TYPE;
+        std::memcpy(phone, &phoneType, sizeof(phone));
+        reply(CMD_PLUGGED, phone, sizeof(phone));
+        reply(CMD_JSON_CONTROL, reinterpret_cast<const uint8_t *>(LOOPBACK_PHONE_INFO), std::strlen(LOOPBACK_PHONE_INFO));
+        return;
+    }
+
+    case CMD_HEARTBEAT:
+        reply(CMD_HEARTBEAT);
+        return;
+    }
+}
+
+void LoopbackTransport::reply(uint32_t type, const uint8_t *payload, uint32_t length)
+{
+    Message message(type, true, length, const_cast<uint8_t *>(payload));
+    if (_cipher && length > 0)
+    {
+        char error[256];
+        if (!message.encrypt(_cipher.get(), error))
+        {
+            log_w("Loopback can't encrypt message %d > %s", type, error);
+            return;
+        }
+    }
+
+    _frame.resize(message.wireSize());
+    message.serialize(_frame.data());
+    deliver(_frame.data(), _frame.size(), *_connected);
+}
+
+std::string LoopbackTransport::status() const
+{
+    std::ostringstream out;
+    out << "loopback " << _received.load(std::memory_order_relaxed);
+    return out.str();
+}
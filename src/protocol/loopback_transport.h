@@ -0,0 +1,41 @@
+#ifndef SRC_PROTOCOL_LOOPBACK_TRANSPORT
+#define SRC_PROTOCOL_LOOPBACK_TRANSPORT
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "protocol/aes_cipher.h"
+#include "protocol/transport.h"
+
+// Dongle stand-in without hardware, answers the handshake, heartbeats and encryption setup
+// and reports a phone as plugged after the open request.
+class LoopbackTransport : public Transport
+{
+public:
+    LoopbackTransport(UsbBuffer &buffer);
+
+    bool open() override { return true; }
+    bool link() override { return true; }
+    bool start(std::atomic<bool> &connected) override;
+    void stop() override {}
+    void close() override {}
+
+    const char *name() const override { return "loopback"; }
+    std::string status() const override;
+
+protected:
+    bool submit(TransportWrite &write) override;
+
+private:
+    void answer(uint32_t type, const uint8_t *payload, uint32_t length);
+    void reply(uint32_t type, const uint8_t *payload = nullptr, uint32_t length = 0);
+
+    std::unique_ptr<AESCipher> _cipher;
+    std::atomic<bool> *_connected;
+    std::atomic<uint32_t> _received;
+    std::vector<uint8_t> _payload;
+    std::vector<uint8_t> _frame;
+};
+
+#endif /* SRC_PROTOCOL_LOOPBACK_TRANSPORT */
@@ -5,13 +5,18 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
+#include <new>
 #include <stdexcept>
 
 #include "protocol/aes_cipher.h"
 #include "protocol/protocol_const.h"
+#include "protocol/usb_buffer.h"
+#include "struct/buffer_pool.h"
 #include "struct/multitouch.h"
 
 #define MESSAGE_MAX_PAYLOAD_SIZE (2 * 1024 * 1024)
+#define MESSAGE_INLINE_SLICES 4 // Slice table kept inside the message, longer payloads get a pooled one
+#define MESSAGE_INLINE_SIZE 96 // Touches, controls and other small payloads are kept inside the message
 
 #pragma pack(push, 1)
 struct Header
@@ -27,7 +32,7 @@ class Message
 {
 public:
     Message()
-        : _header({0, 0, 0, 0}), _data(nullptr), _offset(0), _size(0), _encrypt(false)
+        : _header({0, 0, 0, 0}), _data(nullptr), _offset(0), _size(0), _capacity(0), _padding(0), _slices(_inlineSlices), _sliceCapacity(MESSAGE_INLINE_SLICES), _sliceCount(0), _encrypt(false)
     {
     }
 
@@ -36,19 +41,19 @@ public:
           _data(nullptr),
           _offset(0),
           _size(0),
+          _capacity(0),
+          _padding(0),
+          _slices(_inlineSlices),
+          _sliceCapacity(MESSAGE_INLINE_SLICES),
+          _sliceCount(0),
           _encrypt(encrypt)
     {
         if (size <= 0)
             return;
 
-        if (!buffer)
-        {
-            allocate();
-            return;
-        }
-
-        _data = buffer;
-        _size = size;
+        // Payload lives in pooled storage, provided buffer is copied
+        if (allocate() && buffer)
+            std::memcpy(_data, buffer, size);
     }
 
     Message(uint32_t cmd, uint32_t value, bool encrypt = true)
@@ -62,11 +67,26 @@ public:
 
     ~Message()
     {
-        if (_data)
-        {
-            free(_data);
-            _data = nullptr;
-        }
+        releaseSlices();
+        if (_slices != _inlineSlices)
+            BufferPool::instance().release(_slices, _sliceCapacity * sizeof(SlotSlice));
+        if (_data && _data != _inline)
+            BufferPool::instance().release(_data, _capacity);
+        _data = nullptr;
+    }
+
+    // Message objects are recycled through the pool as well
+    static void *operator new(size_t size)
+    {
+        void *result = BufferPool::instance().acquire(size);
+        if (!result)
+            throw std::bad_alloc();
+        return result;
+    }
+
+    static void operator delete(void *ptr, size_t size)
+    {
+        BufferPool::instance().release(ptr, size);
     }
 
     uint8_t *allocate(uint32_t padding = 0)
@@ -75,19 +95,122 @@ public:
             return nullptr;
 
         _size = _header.length + padding;
-        _data = static_cast<uint8_t *>(malloc(_size));
+        _capacity = _size;
+        if (_capacity <= MESSAGE_INLINE_SIZE)
+            _data = _inline;
+        else
+            _data = static_cast<uint8_t *>(BufferPool::instance().acquire(_capacity));
         if (!_data)
-            _size = 0;
+            _size = _capacity = 0;
         else
             std::fill(_data + _header.length, _data + _header.length + padding, 0);
         return _data;
     }
 
+    // Append payload that stays in the usb slot, payload is joined only when a consumer asks for it
+    bool attach(const SlotSlice &slice, uint32_t padding = 0)
+    {
+        if (_header.length <= 0 || _size + slice.length > static_cast<uint32_t>(_header.length))
+        {
+            slice.slot->release();
+            return false;
+        }
+
+        if (_sliceCount == 0 && _data)
+        {
+            std::memcpy(_data + _size, slice.data, slice.length);
+            _size += slice.length;
+            slice.slot->release();
+            return true;
+        }
+
+        if (_sliceCount == _sliceCapacity && !growSlices())
+        {
+            slice.slot->release();
+            return false;
+        }
+
+        _padding = padding;
+        _slices[_sliceCount++] = slice;
+        _size += slice.length;
+        return true;
+    }
+
+    // Payload split across several slots is joined into one buffer
+    bool flatten() const
+    {
+        if (_sliceCount < 2)
+            return true;
+        return join();
+    }
+
+    bool sliced() const { return _sliceCount > 0; }
+
+    // Calls visit(data, length) for every contiguous piece of the payload after the offset until it returns false.
+    // Sliced payload is walked where it lies in the usb slots, nothing is joined.
+    template <typename Visit>
+    void visit(Visit visit) const
+    {
+        if (_sliceCount == 0)
+        {
+            if (_data && allocated() && length() > 0)
+                visit(static_cast<const uint8_t *>(_data + _offset), static_cast<uint32_t>(length()));
+            return;
+        }
+
+        uint32_t skip = _offset;
+        for (uint32_t i = 0; i < _sliceCount; i++)
+        {
+            if (skip >= _slices[i].length)
+            {
+                skip -= _slices[i].length;
+                continue;
+            }
+            if (!visit(static_cast<const uint8_t *>(_slices[i].data + skip), _slices[i].length - skip))
+                return;
+            skip = 0;
+        }
+    }
+
+    // Called with the opaque value and buffer once the detached payload is not used anymore
+    using PayloadFree = void (*)(void *opaque, uint8_t *buffer);
+
+    // Hands the payload storage over to the caller so it can be shared without a copy,
+    // message is left without payload. Inline payload can't outlive the message and stays.
+    bool detach(uint8_t *&buffer, uint32_t &size, PayloadFree &release, void *&opaque)
+    {
+        // Padding must be zero for the decoder, mid slot payload is followed by the next message
+        if (_sliceCount == 1 && !_slices[0].padded && !join())
+            return false;
+
+        if (_sliceCount == 1)
+        {
+            buffer = _slices[0].data;
+            size = _slices[0].length + _padding;
+            release = releaseSlot;
+            opaque = _slices[0].slot;
+            _sliceCount = 0;
+        }
+        else
+        {
+            if (!flatten() || !_data || _data == _inline)
+                return false;
+            buffer = _data;
+            size = _capacity;
+            release = releasePooled;
+            opaque = reinterpret_cast<void *>(static_cast<uintptr_t>(_capacity));
+            _data = nullptr;
+        }
+        _size = _capacity = 0;
+        return true;
+    }
+
     int getInt(uint32_t offset) const
     {
         int result = 0;
-        if (_data && offset + sizeof(int) <= _size)
-            memcpy(&result, _data + offset, sizeof(int));
+        const uint8_t *payload = contiguous();
+        if (payload && offset + sizeof(int) <= _size)
+            memcpy(&result, payload + offset, sizeof(int));
         return result;
     }
 
@@ -110,7 +233,7 @@ public:
         if (!allocated())
             return AESCipher::error(err, "Message data is not allocated");
 
-        if (!cipher->encrypt(_data, _header.length, err))
+        if (!cipher->encrypt(contiguous(), _header.length, err))
             return false;
 
         _header.magic = MAGIC_ENC;
@@ -128,7 +251,7 @@ public:
         if (!allocated())
             return AESCipher::error(err, "Message data is not allocated");
 
-        if (!cipher->decrypt(_data, _header.length, err))
+        if (!cipher->decrypt(contiguous(), _header.length, err))
             return false;
 
         _header.magic = MAGIC;
@@ -137,7 +260,32 @@ public:
 
     bool isMotion() const
     {
-        return _header.type == CMD_TOUCH && getInt(0) == 15;
+        if (_header.type == CMD_TOUCH)
+            return getInt(0) == TOUCH_MOVE;
+
+        if (_header.type != CMD_MULTI_TOUCH || _header.length <= 0)
+            return false;
+        for (uint32_t offset = 0; offset + sizeof(Multitouch::Touch) <= static_cast<uint32_t>(_header.length); offset += sizeof(Multitouch::Touch))
+        {
+            if (getInt(offset + 8) != MULTI_TOUCH_MOVE)
+                return false;
+        }
+        return true;
+    }
+
+    // Newer motion of the same pointers makes this one obsolete
+    bool replacedBy(const Message &other) const
+    {
+        if (_header.type != other._header.type || _header.length != other._header.length || !isMotion() || !other.isMotion())
+            return false;
+        if (_header.type == CMD_TOUCH)
+            return true;
+        for (uint32_t offset = 0; offset + sizeof(Multitouch::Touch) <= static_cast<uint32_t>(_header.length); offset += sizeof(Multitouch::Touch))
+        {
+            if (getInt(offset + 12) != other.getInt(offset + 12))
+                return false;
+        }
+        return true;
     }
 
     static std::unique_ptr<Message> Init(int width, int height, int fps)
@@ -237,12 +385,12 @@ public:
 
     static std::unique_ptr<Message> Click(float x, float y, bool down)
     {
-        return Touch(down ? 14 : 16, x, y);
+        return Touch(down ? TOUCH_DOWN : TOUCH_UP, x, y);
     }
 
     static std::unique_ptr<Message> Move(float x, float y)
     {
-        return Touch(15, x, y);
+        return Touch(TOUCH_MOVE, x, y);
     }
 
     static std::unique_ptr<Message> Audio(int length)
@@ -284,9 +432,24 @@ public:
     bool encrypted() const { return _header.magic == MAGIC_ENC; }
     uint8_t *header() { return reinterpret_cast<uint8_t *>(&_header); }
     uint32_t headerSize() const { return sizeof(Header); }
+    uint32_t wireSize() const { return sizeof(Header) + (_header.length > 0 ? _header.length : 0); }
+
+    // Header followed by payload as it goes to the dongle, dst must hold wireSize() bytes
+    void serialize(uint8_t *dst) const
+    {
+        std::memcpy(dst, &_header, sizeof(Header));
+        const uint8_t *payload = contiguous();
+        if (payload && _header.length > 0)
+            std::memcpy(dst + sizeof(Header), payload, _header.length);
+    }
     uint32_t type() const { return _header.type; }
     int32_t length() const { return _header.length - _offset; }
-    uint8_t *data() const { return _data ? _data + _offset : nullptr; }
+    uint32_t offset() const { return _offset; }
+    uint8_t *data() const
+    {
+        uint8_t *payload = contiguous();
+        return payload ? payload + _offset : nullptr;
+    }
 
     bool invalidMagic() const { return _header.magic != MAGIC_ENC && _header.magic != MAGIC; }
     bool invalidChecksum() const { return _header.typecheck != ~_header.type; }
@@ -358,11 +521,84 @@ private:
         write_uint32_le(dst, bits);
     }
 
+    uint8_t *contiguous() const
+    {
+        if (_sliceCount == 1)
+            return _slices[0].data;
+        if (_sliceCount > 1 && !flatten())
+            return nullptr;
+        return _data;
+    }
+
+    static void releaseSlot(void *opaque, uint8_t *)
+    {
+        static_cast<DataSlot *>(opaque)->release();
+    }
+
+    static void releasePooled(void *opaque, uint8_t *buffer)
+    {
+        BufferPool::instance().release(buffer, static_cast<uint32_t>(reinterpret_cast<uintptr_t>(opaque)));
+    }
+
+    // Slices are copied into pooled storage followed by zeroed padding
+    bool join() const
+    {
+        uint32_t capacity = _header.length + _padding;
+        uint8_t *buffer = capacity <= MESSAGE_INLINE_SIZE ? _inline : static_cast<uint8_t *>(BufferPool::instance().acquire(capacity));
+        if (!buffer)
+            return false;
+
+        uint32_t filled = 0;
+        for (uint32_t i = 0; i < _sliceCount; i++)
+        {
+            std::memcpy(buffer + filled, _slices[i].data, _slices[i].length);
+            filled += _slices[i].length;
+        }
+        std::fill(buffer + filled, buffer + _header.length + _padding, 0);
+
+        releaseSlices();
+        _data = buffer;
+        _size = filled;
+        _capacity = capacity;
+        return true;
+    }
+
+    // Payload spread over many slots gets a bigger slice table instead of a copy
+    bool growSlices()
+    {
+        uint32_t capacity = _sliceCapacity * 2;
+        SlotSlice *slices = static_cast<SlotSlice *>(BufferPool::instance().acquire(capacity * sizeof(SlotSlice)));
+        if (!slices)
+            return false;
+
+        std::memcpy(static_cast<void *>(slices), _slices, _sliceCount * sizeof(SlotSlice));
+        if (_slices != _inlineSlices)
+            BufferPool::instance().release(_slices, _sliceCapacity * sizeof(SlotSlice));
+        _slices = slices;
+        _sliceCapacity = capacity;
+        return true;
+    }
+
+    void releaseSlices() const
+    {
+        for (uint32_t i = 0; i < _sliceCount; i++)
+            _slices[i].slot->release();
+        _sliceCount = 0;
+    }
+
     Header _header;
-    uint8_t *_data;
+    // Payload can be joined lazily by the consumer, so storage is mutable
+    mutable uint8_t *_data;
     uint32_t _offset;
-    uint32_t _size;
+    mutable uint32_t _size;
+    mutable uint32_t _capacity;
+    uint32_t _padding;
+    SlotSlice *_slices;
+    uint32_t _sliceCapacity;
+    mutable uint32_t _sliceCount;
     bool _encrypt;
+    mutable uint8_t _inline[MESSAGE_INLINE_SIZE];
+    SlotSlice _inlineSlices[MESSAGE_INLINE_SLICES];
 };
 
 #endif /* SRC_PROTOCOL_MESSAGE */
@@ -0,0 +1,45 @@
+#include "protocol/phone_info.h"
+
+#include "common/json_reader.h"
+
+bool PhoneInfo::update(const uint8_t *data, int32_t length)
+{
+    JsonReader reader(data, length);
+    JsonField field;
+    while (reader.next(field))
+    {
+        if (field.is("MDLinkType"))
+            field.copy(linkType, sizeof(linkType));
+        else if (field.is("btName"))
+            field.copy(name, sizeof(name));
+        else if (field.is("MDModel"))
+            field.copy(model, sizeof(model));
+        else if (field.is("MDOSVersion"))
+            field.copy(osVersion, sizeof(osVersion));
+        else if (field.is("btMacAddr"))
+            field.copy(btAddress, sizeof(btAddress));
+    }
+    return reader.valid();
+}
+
+bool MediaInfo::update(const uint8_t *data, int32_t length)
+{
+    JsonReader reader(data, length);
+    JsonField field;
+    while (reader.next(field))
+    {
+        if (field.is("MediaSongName"))
+            field.copy(song, sizeof(song));
+        else if (field.is("MediaArtistName"))
+            field.copy(artist, sizeof(artist));
+        else if (field.is("MediaAlbumName"))
+            field.copy(album, sizeof(album));
+        else if (field.is("MediaAPPName"))
+            field.copy(app, sizeof(app));
+        else if (field.is("MediaSongDuration"))
+            duration = field.toInt();
+        else if (field.is("MediaSongPlayTime"))
+            position = field.toInt();
+    }
+    return reader.valid();
+}
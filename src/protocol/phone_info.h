@@ -0,0 +1,37 @@
+#ifndef SRC_PROTOCOL_PHONE_INFO
+#define SRC_PROTOCOL_PHONE_INFO
+
+#include <cstdint>
+
+#define PHONE_INFO_TEXT 64
+#define MEDIA_INFO_TEXT 128
+#define MEDIA_INFO_JSON 1   // Media info payload type with metadata, others carry album art
+#define MEDIA_INFO_OFFSET 4 // Payload type precedes the data
+
+// Phone details reported by the dongle in CMD_JSON_CONTROL
+struct PhoneInfo
+{
+    char linkType[PHONE_INFO_TEXT] = "unknown"; // MDLinkType
+    char name[PHONE_INFO_TEXT] = "phone";       // btName
+    char model[PHONE_INFO_TEXT] = "";           // MDModel
+    char osVersion[PHONE_INFO_TEXT] = "";       // MDOSVersion
+    char btAddress[PHONE_INFO_TEXT] = "";       // btMacAddr
+
+    // Fields missing in the message keep their values, false if message is not a JSON object
+    bool update(const uint8_t *data, int32_t length);
+};
+
+// Now playing metadata from CMD_MEDIA_INFO
+struct MediaInfo
+{
+    char song[MEDIA_INFO_TEXT] = "";
+    char artist[MEDIA_INFO_TEXT] = "";
+    char album[MEDIA_INFO_TEXT] = "";
+    char app[PHONE_INFO_TEXT] = "";
+    int32_t duration = 0; // ms
+    int32_t position = 0; // ms
+
+    bool update(const uint8_t *data, int32_t length);
+};
+
+#endif /* SRC_PROTOCOL_PHONE_INFO */
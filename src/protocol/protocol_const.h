@@ -12,6 +12,9 @@
 #define MAGIC 0x55aa55aa
 #define MAGIC_ENC 0x55bb55bb
 
+#define PROTOCOL_HEARTBEAT_DELAY 3000
+#define ENCRYPTION_BASE "SkBRDy3gmrw1ieH0"
+
 #define CMD_OPEN 1
 #define CMD_PLUGGED 2
 #define CMD_STATE 3
@@ -37,6 +40,13 @@
 #define CMD_VERSION 204
 #define CMD_ENCRYPTION 240
 
+#define PROTOCOL_CMD_COUNT 256 // Size of per command tables, larger ids share entry 0
+
+#define TOUCH_DOWN 14
+#define TOUCH_MOVE 15
+#define TOUCH_UP 16
+#define MULTI_TOUCH_MOVE 2
+
 #define BTN_SIRI 5
 #define BTN_MICROPHONE 7
 #define BTN_SCREEN_REFRESH 12
@@ -0,0 +1,145 @@
+#include "protocol/replay_transport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <vector>
+
+#include "common/logger.h"
+#include "common/threading.h"
+#include "protocol/capture.h"
+
+#define REPLAY_MAX_RECORD (16 * 1024 * 1024)
+#define REPLAY_SLEEP_STEP 100
+
+ReplayTransport::ReplayTransport(UsbBuffer &buffer, const std::string &path, bool realtime)
+    : Transport(buffer),
+      _path(path),
+      _realtime(realtime),
+      _file(nullptr),
+      _connected(nullptr),
+      _finished(false),
+      _records(0)
+{
+}
+
+ReplayTransport::~ReplayTransport()
+{
+    close();
+}
+
+bool ReplayTransport::open()
+{
+    if (_finished)
+        return false;
+
+    _file = fopen(_path.c_str(), "rb");
+    if (!_file)
+        log_d("Can't open replay file %s", _path.c_str());
+    return _file != nullptr;
+}
+
+bool ReplayTransport::link()
+{
+    CaptureHeader header;
+    fseek(_file, 0, SEEK_SET);
+    if (fread(&header, sizeof(header), 1, _file) != 1 || header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION)
+    {
+        log_w("Replay file %s is not a usb capture", _path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ReplayTransport::start(std::atomic<bool> &connected)
+{
+    _connected = &connected;
+    _records = 0;
+    log_i("Replaying %s %s", _path.c_str(), _realtime ? "in realtime" : "as fast as possible");
+    _readThread = std::thread(&ReplayTransport::readLoop, this);
+    return true;
+}
+
+void ReplayTransport::stop()
+{
+    if (_readThread.joinable())
+        _readThread.join();
+}
+
+void ReplayTransport::close()
+{
+    if (!_file)
+        return;
+    fclose(_file);
+    _file = nullptr;
+}
+
+bool ReplayTransport::submit(TransportWrite &write)
+{
+    // Capture already holds dongle answers, nothing to send
+    complete(write);
+    return true;
+}
+
+void ReplayTransport::readLoop()
+{
+    setThreadName("usb-read");
+    log_d("Replay reading thread started");
+
+    std::vector<uint8_t> data;
+    CaptureRecord record;
+    uint64_t first = 0;
+    bool started = false;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    while (*_connected && fread(&record, sizeof(record), 1, _file) == 1)
+    {
+        if (record.length > REPLAY_MAX_RECORD)
+        {
+            log_w("Replay record is too large %u, file is corrupted", record.length);
+            break;
+        }
+
+        data.resize(record.length);
+        if (record.length > 0 && fread(data.data(), record.length, 1, _file) != 1)
+            break;
+
+        if (record.direction != CAPTURE_INBOUND)
+            continue;
+
+        if (!started)
+        {
+            first = record.timestamp;
+            begin = std::chrono::steady_clock::now();
+            started = true;
+        }
+
+        if (_realtime)
+        {
+            // Sleep in steps to notice disconnect during long pauses of the recording
+            std::chrono::steady_clock::time_point due = begin + std::chrono::microseconds(record.timestamp - first);
+            while (*_connected && std::chrono::steady_clock::now() < due)
+                std::this_thread::sleep_until(std::min(due, std::chrono::steady_clock::now() + std::chrono::milliseconds(REPLAY_SLEEP_STEP)));
+        }
+
+        if (!deliver(data.data(), record.length, *_connected))
+            break;
+        _records.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (*_connected)
+    {
+        int duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+        log_i("Replay finished > %u transfers, %u bytes in %d ms", _records.load(), transfered(), duration);
+        _finished = true;
+    }
+
+    log_v("Replay reading thread stopped");
+}
+
+std::string ReplayTransport::status() const
+{
+    std::ostringstream out;
+    out << "replay " << _records.load(std::memory_order_relaxed) << (_finished ? " done" : "");
+    return out.str();
+}
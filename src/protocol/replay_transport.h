@@ -0,0 +1,45 @@
+#ifndef SRC_PROTOCOL_REPLAY_TRANSPORT
+#define SRC_PROTOCOL_REPLAY_TRANSPORT
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include "protocol/transport.h"
+
+// Feeds inbound data of a captured usb session, outbound writes are dropped.
+// Realtime mode keeps the recorded gaps between transfers, otherwise data goes as fast as it is consumed.
+class ReplayTransport : public Transport
+{
+public:
+    ReplayTransport(UsbBuffer &buffer, const std::string &path, bool realtime);
+    ~ReplayTransport() override;
+
+    bool open() override;
+    bool link() override;
+    bool start(std::atomic<bool> &connected) override;
+    void stop() override;
+    void close() override;
+
+    const char *name() const override { return "replay"; }
+    std::string status() const override;
+
+    bool finished() const { return _finished.load(std::memory_order_acquire); }
+
+protected:
+    bool submit(TransportWrite &write) override;
+
+private:
+    void readLoop();
+
+    std::string _path;
+    bool _realtime;
+    FILE *_file;
+    std::thread _readThread;
+    std::atomic<bool> *_connected;
+    std::atomic<bool> _finished;
+    std::atomic<uint32_t> _records;
+};
+
+#endif /* SRC_PROTOCOL_REPLAY_TRANSPORT */
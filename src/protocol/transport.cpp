@@ -0,0 +1,131 @@
+#include "protocol/transport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "common/logger.h"
+#include "protocol/libusb_transport.h"
+#include "protocol/loopback_transport.h"
+#include "protocol/replay_transport.h"
+#include "settings.h"
+
+Transport::Transport(UsbBuffer &buffer)
+    : _buffer(buffer),
+      _writes(std::max(1, Settings::usbWriteWindow.value)),
+      _transfered(0),
+      _capture(nullptr)
+{
+    for (TransportWrite &write : _writes)
+        write.owner = this;
+}
+
+Transport::~Transport()
+{
+    for (TransportWrite &write : _writes)
+    {
+        free(write.buffer);
+        write.buffer = nullptr;
+    }
+}
+
+std::unique_ptr<Transport> Transport::create(UsbBuffer &buffer, const std::string &device)
+{
+    const std::string &type = Settings::transport.value;
+    if (type == "replay")
+        return std::make_unique<ReplayTransport>(buffer, Settings::transportFile.value, Settings::replayRealtime);
+    if (type == "loopback")
+        return std::make_unique<LoopbackTransport>(buffer);
+    if (type != "usb")
+        log_w("Unknown transport %s, using usb", type.c_str());
+    return std::make_unique<LibusbTransport>(buffer, device);
+}
+
+TransportWrite *Transport::acquireWrite(std::atomic<bool> &connected, uint32_t timeoutMs)
+{
+    TransportWrite *result = nullptr;
+    auto ready = [&]()
+    {
+        for (TransportWrite &write : _writes)
+        {
+            if (!write.busy.load(std::memory_order_acquire))
+            {
+                result = &write;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    while (!ready())
+    {
+        if (!_writeWaiter.wait(ready, connected, timeoutMs))
+            return nullptr;
+    }
+    result->length = 0;
+    return result;
+}
+
+void Transport::submitWrite(TransportWrite &write)
+{
+    if (_capture)
+        _capture->capture(CAPTURE_OUTBOUND, write.buffer, write.length);
+
+    write.busy.store(true, std::memory_order_release);
+    if (!submit(write))
+        complete(write);
+}
+
+void Transport::releaseWrite(TransportWrite &write)
+{
+    write.length = 0;
+}
+
+void Transport::complete(TransportWrite &write)
+{
+    write.busy.store(false, std::memory_order_release);
+    _writeWaiter.notify();
+}
+
+bool Transport::pendingWrites() const
+{
+    return std::any_of(_writes.begin(), _writes.end(), [](const TransportWrite &write)
+                       { return write.busy.load(std::memory_order_acquire); });
+}
+
+bool Transport::waitWrites(uint32_t timeoutMs)
+{
+    // Connection flag is already down while writes are drained, so wait on a flag of our own
+    std::atomic<bool> waiting(true);
+    auto idle = [this]()
+    { return !pendingWrites(); };
+    _writeWaiter.wait(idle, waiting, timeoutMs);
+    return idle();
+}
+
+bool Transport::deliver(const uint8_t *data, uint32_t length, std::atomic<bool> &active)
+{
+    while (length > 0)
+    {
+        DataSlot *slot = _buffer.get();
+        if (!slot)
+        {
+            if (!active)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        uint32_t size = std::min<uint32_t>(length, slot->size);
+        std::memcpy(slot->data, data, size);
+        if (_capture)
+            _capture->capture(CAPTURE_INBOUND, data, size);
+        slot->commit(size);
+        _transfered.fetch_add(size, std::memory_order_relaxed);
+        data += size;
+        length -= size;
+    }
+    return true;
+}
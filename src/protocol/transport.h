@@ -0,0 +1,87 @@
+#ifndef SRC_PROTOCOL_TRANSPORT
+#define SRC_PROTOCOL_TRANSPORT
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/adaptive_waiter.h"
+#include "protocol/capture.h"
+#include "protocol/usb_buffer.h"
+
+class Transport;
+
+// Outgoing transfer, buffer is grown by the writer and owned by the transport
+struct TransportWrite
+{
+    Transport *owner = nullptr;
+    uint8_t *buffer = nullptr;
+    uint32_t capacity = 0;
+    uint32_t length = 0;
+    void *handle = nullptr;
+    std::atomic<bool> busy{false};
+};
+
+// Byte pipe to the dongle used by Connection.
+// Inbound data is committed to the usb buffer slots in order, outbound data goes through a small window of writes.
+class Transport
+{
+public:
+    Transport(UsbBuffer &buffer);
+    virtual ~Transport();
+
+    Transport(const Transport &) = delete;
+    Transport &operator=(const Transport &) = delete;
+
+    // Transport selected with "transport" setting, device is the usb port path the session is bound to
+    static std::unique_ptr<Transport> create(UsbBuffer &buffer, const std::string &device);
+
+    // Find the device, false when there is nothing to link to
+    virtual bool open() = 0;
+    // Wait until a device may have appeared, false when transport can't tell and caller has to wait itself
+    virtual bool waitDevice(std::atomic<bool> &, uint32_t) { return false; }
+    // Prepare the device for transfers, can be retried
+    virtual bool link() = 0;
+    // Start filling the usb buffer, connected flag is cleared when device is lost
+    virtual bool start(std::atomic<bool> &connected) = 0;
+    // Stop reading and finish pending writes, connected flag is already cleared
+    virtual void stop() = 0;
+    virtual void close() = 0;
+
+    virtual const char *name() const = 0;
+    virtual std::string status() const { return name(); }
+
+    // Wait for a free write, nullptr once connected flag is cleared
+    TransportWrite *acquireWrite(std::atomic<bool> &connected, uint32_t timeoutMs);
+    void submitWrite(TransportWrite &write);
+    // Acquired write with nothing to send goes back unused
+    void releaseWrite(TransportWrite &write);
+    void notify() { _writeWaiter.notify(); }
+    void setCapture(CaptureWriter *capture) { _capture = capture; }
+
+    uint32_t transfered() const { return _transfered.load(std::memory_order_acquire); }
+
+protected:
+    virtual bool submit(TransportWrite &write) = 0;
+
+    // Called by implementation once write is done, from any thread
+    void complete(TransportWrite &write);
+    bool pendingWrites() const;
+    // Sleep until every submitted write is completed, false on timeout
+    bool waitWrites(uint32_t timeoutMs);
+
+    // Copy data into usb buffer slots, waits for free slots while active
+    bool deliver(const uint8_t *data, uint32_t length, std::atomic<bool> &active);
+
+    UsbBuffer &_buffer;
+    std::vector<TransportWrite> _writes;
+    std::atomic<uint32_t> _transfered;
+    CaptureWriter *_capture;
+
+private:
+    AdaptiveWaiter _writeWaiter;
+};
+
+#endif /* SRC_PROTOCOL_TRANSPORT */
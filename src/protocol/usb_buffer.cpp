@@ -4,8 +4,10 @@
 #include <cstring>
 #include <stdexcept>
 
+#include "protocol/header_scanner.h"
+
 DataSlot::DataSlot()
-    : ready(false), offset(0), length(0), size(0), data(nullptr), _cv(nullptr)
+    : ready(false), refs(0), offset(0), length(0), size(0), data(nullptr), _waiter(nullptr), _padding(0)
 {
 }
 
@@ -19,14 +21,17 @@ DataSlot::~DataSlot()
     }
 }
 
-void DataSlot::init(uint32_t slotSize, std::condition_variable *condition)
+void DataSlot::init(uint32_t slotSize, uint32_t padding, AdaptiveWaiter *waiter)
 {
     ready.store(false);
+    refs.store(0);
     offset = 0;
     length = 0;
     size = slotSize;
-    data = static_cast<uint8_t *>(malloc(size));
-    _cv = condition;
+    // Zeroed tail keeps in place payloads readable past the end of the slot (decoder padding)
+    data = static_cast<uint8_t *>(calloc(size + padding, 1));
+    _waiter = waiter;
+    _padding = padding;
 }
 
 void DataSlot::reset()
@@ -38,12 +43,16 @@ void DataSlot::reset()
 
 void DataSlot::commit(size_t dataSize)
 {
+    // Short transfer leaves stale bytes where the padding of its last payload goes
+    if (dataSize < size && _padding > 0)
+        std::memset(data + dataSize, 0, _padding);
     length = dataSize;
     offset = 0;
-    ready.store(true);
+    ready.store(true, std::memory_order_release);
 
-    if (_cv)
-        _cv->notify_one();
+    // Syscall only if processing thread is parked
+    if (_waiter)
+        _waiter->notify();
 }
 
 bool DataSlot::consume(size_t dataSize)
@@ -51,7 +60,7 @@ bool DataSlot::consume(size_t dataSize)
     offset += dataSize;
     if (offset < length)
         return false;
-    ready.store(false);
+    ready.store(false, std::memory_order_release);
     return true;
 }
 
@@ -60,7 +69,7 @@ size_t DataSlot::remain() const
     return length > offset ? length - offset : 0;
 }
 
-UsbBuffer::UsbBuffer(uint16_t slotCount, uint32_t slotSize)
+UsbBuffer::UsbBuffer(uint16_t slotCount, uint32_t slotSize, uint32_t padding)
     : _slots(nullptr), _size(slotCount), _writeSlot(0), _readSlot(0)
 {
     if (slotCount == 0 || slotSize == 0)
@@ -70,13 +79,13 @@ UsbBuffer::UsbBuffer(uint16_t slotCount, uint32_t slotSize)
 
     for (uint16_t i = 0; i < _size; i++)
     {
-        _slots[i].init(slotSize, &_cv);
+        _slots[i].init(slotSize, padding, &_waiter);
     }
 }
 
 UsbBuffer::~UsbBuffer()
 {
-    _cv.notify_all();
+    _waiter.notify();
     if (_slots)
     {
         delete[] _slots;
@@ -85,12 +94,11 @@ UsbBuffer::~UsbBuffer()
 
 DataSlot *UsbBuffer::get()
 {
-    if (_slots[_writeSlot].ready.load())
+    uint16_t index = _writeSlot.load(std::memory_order_relaxed);
+    if (!_slots[index].available())
         return nullptr;
-    DataSlot *slot = &(_slots[_writeSlot]);
-    _writeSlot++;
-    if (_writeSlot >= _size)
-        _writeSlot = 0;
+    DataSlot *slot = &(_slots[index]);
+    _writeSlot.store(index + 1 >= _size ? 0 : index + 1, std::memory_order_relaxed);
     return slot;
 }
 
@@ -102,26 +110,17 @@ bool UsbBuffer::read(uint8_t *dst, uint32_t length, std::atomic<bool> &active)
     size_t done = 0;
     while (length > 0)
     {
-        while (!_slots[_readSlot].ready.load())
-        {
-            std::unique_lock<std::mutex> lock(_mutex);
-            _cv.wait(lock, [&]()
-                     { return !active.load() || _slots[_readSlot].ready.load(); });
-            if (!active.load())
-                return false;
-        }
-
-        size_t copy = _slots[_readSlot].remain();
+        if (!waitReady(active))
+            return false;
+
+        DataSlot &slot = _slots[_readSlot.load(std::memory_order_relaxed)];
+        size_t copy = slot.remain();
         if (copy > length)
             copy = length;
         if (dst != nullptr)
-            std::memcpy(dst + done, _slots[_readSlot].data + _slots[_readSlot].offset, copy);
-        if (_slots[_readSlot].consume(copy))
-        {
-            _readSlot++;
-            if (_readSlot >= _size)
-                _readSlot = 0;
-        }
+            std::memcpy(dst + done, slot.data + slot.offset, copy);
+        if (slot.consume(copy))
+            next();
         done += copy;
         length -= copy;
     }
@@ -129,21 +128,68 @@ bool UsbBuffer::read(uint8_t *dst, uint32_t length, std::atomic<bool> &active)
     return active.load();
 }
 
-void UsbBuffer::discard()
+bool UsbBuffer::slice(SlotSlice &slice, uint32_t length, std::atomic<bool> &active)
+{
+    if (length == 0 || !waitReady(active))
+        return false;
+
+    DataSlot &slot = _slots[_readSlot.load(std::memory_order_relaxed)];
+    size_t size = slot.remain();
+    if (size > length)
+        size = length;
+
+    slot.retain();
+    slice.slot = &slot;
+    slice.data = slot.data + slot.offset;
+    slice.length = size;
+    slice.padded = slot.offset + size == slot.length;
+
+    if (slot.consume(size))
+        next();
+    return true;
+}
+
+bool UsbBuffer::waitReady(std::atomic<bool> &active)
+{
+    const DataSlot &slot = _slots[_readSlot.load(std::memory_order_relaxed)];
+    if (slot.ready.load(std::memory_order_acquire))
+        return true;
+
+    _waiter.wait([&]()
+                 { return slot.ready.load(std::memory_order_acquire); },
+                 active);
+    return active.load() && slot.ready.load(std::memory_order_acquire);
+}
+
+void UsbBuffer::next()
 {
-    if (!_slots[_readSlot].ready.load())
-        return;
+    uint16_t index = _readSlot.load(std::memory_order_relaxed) + 1;
+    _readSlot.store(index >= _size ? 0 : index, std::memory_order_relaxed);
+}
 
-    _slots[_readSlot].ready.store(false);
-    _readSlot++;
-    if (_readSlot >= _size)
-        _readSlot = 0;
+// Skip buffered bytes up to the next position where a message header starts
+bool UsbBuffer::resync(uint32_t &skipped, std::atomic<bool> &active)
+{
+    while (waitReady(active))
+    {
+        DataSlot &slot = _slots[_readSlot.load(std::memory_order_relaxed)];
+        uint32_t remain = slot.remain();
+        int32_t offset = findHeader(slot.data + slot.offset, remain);
+        uint32_t skip = offset < 0 ? remain : offset;
+
+        skipped += skip;
+        if (slot.consume(skip))
+            next();
+        if (offset >= 0)
+            return true;
+    }
+    return false;
 }
 
 void UsbBuffer::reset()
 {
-    _readSlot = 0;
-    _writeSlot = 0;
+    _readSlot.store(0);
+    _writeSlot.store(0);
     for (uint16_t i = 0; i < _size; i++)
     {
         _slots[i].reset();
@@ -152,12 +198,12 @@ void UsbBuffer::reset()
 
 void UsbBuffer::notify()
 {
-    _cv.notify_all();
+    _waiter.notify();
 }
 
 int UsbBuffer::count() const
 {
-    int result = _writeSlot - _readSlot;
+    int result = _writeSlot.load(std::memory_order_relaxed) - _readSlot.load(std::memory_order_relaxed);
     if (result < 0)
         result += _size;
     return result;
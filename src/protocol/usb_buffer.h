@@ -4,35 +4,56 @@
 #include <cstddef>
 #include <cstdint>
 #include <atomic>
-#include <mutex>
-#include <condition_variable>
 
-class DataSlot
+#include "common/adaptive_waiter.h"
+
+#define USB_BUFFER_CACHE_LINE 64
+
+// Slot ready flag is the hand over point between usb reader (producer) and processing thread (consumer).
+// Every slot takes its own cache line so flags of neighbouring slots do not bounce between cores.
+class alignas(USB_BUFFER_CACHE_LINE) DataSlot
 {
 public:
     DataSlot();
     ~DataSlot();
 
-    void init(uint32_t slotSize, std::condition_variable *condition);
+    void init(uint32_t slotSize, uint32_t padding, AdaptiveWaiter *waiter);
     void reset();
     void commit(size_t dataSize);
     bool consume(size_t dataSize);
     size_t remain() const;
 
+    // Payload references held by messages, slot is not reused until all of them are released
+    void retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+    void release() { refs.fetch_sub(1, std::memory_order_release); }
+    bool available() const { return !ready.load(std::memory_order_acquire) && refs.load(std::memory_order_acquire) == 0; }
+
     std::atomic<bool> ready;
+    std::atomic<uint16_t> refs;
     size_t offset;
     size_t length;
     size_t size;
     uint8_t *data;
 
 private:
-    std::condition_variable *_cv;
+    AdaptiveWaiter *_waiter;
+    uint32_t _padding;
 };
 
+// Part of the slot data referenced in place
+struct SlotSlice
+{
+    DataSlot *slot = nullptr;
+    uint8_t *data = nullptr;
+    uint32_t length = 0;
+    bool padded = false; // Ends where the transfer ended, zeroed padding follows
+};
+
+// Single producer, single consumer ring of usb transfer slots
 class UsbBuffer
 {
 public:
-    UsbBuffer(uint16_t slotCount, uint32_t slotSize);
+    UsbBuffer(uint16_t slotCount, uint32_t slotSize, uint32_t padding = 0);
     ~UsbBuffer();
 
     UsbBuffer(const UsbBuffer &) = delete;
@@ -40,20 +61,24 @@ public:
 
     DataSlot *get();
     bool read(uint8_t *dst, uint32_t length, std::atomic<bool> &active);
-    void discard();
+    bool slice(SlotSlice &slice, uint32_t length, std::atomic<bool> &active);
+    bool resync(uint32_t &skipped, std::atomic<bool> &active);
 
     void reset();
     void notify();
     int count() const;
 
 private:
-    std::mutex _mutex;
-    std::condition_variable _cv;
+    bool waitReady(std::atomic<bool> &active);
+    void next();
 
     DataSlot *_slots;
     uint16_t _size;
-    uint16_t _writeSlot;
-    uint16_t _readSlot;
+    AdaptiveWaiter _waiter;
+
+    // Producer and consumer positions are kept on separate cache lines
+    alignas(USB_BUFFER_CACHE_LINE) std::atomic<uint16_t> _writeSlot;
+    alignas(USB_BUFFER_CACHE_LINE) std::atomic<uint16_t> _readSlot;
 };
 
 #endif /* SRC_STRUCT_USB_BUFFER */
@@ -0,0 +1,125 @@
+#include "protocol/usb_context.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "common/logger.h"
+#include "common/threading.h"
+
+#define USB_PORT_DEPTH 7 // Maximum hub chain allowed by usb specification
+
+std::shared_ptr<UsbContext> UsbContext::acquire()
+{
+    static std::mutex mutex;
+    static std::weak_ptr<UsbContext> shared;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<UsbContext> result = shared.lock();
+    if (!result)
+    {
+        result = std::shared_ptr<UsbContext>(new UsbContext());
+        shared = result;
+    }
+    return result;
+}
+
+UsbContext::UsbContext()
+    : _context(nullptr),
+      _active(true),
+      _streaming(0),
+      _rounds(0)
+{
+    int result = libusb_init(&_context);
+    if (result < 0)
+        throw std::runtime_error(std::string("Can't initialise USB: ") + libusb_error_name(result));
+
+    _thread = std::thread(&UsbContext::eventLoop, this);
+}
+
+UsbContext::~UsbContext()
+{
+    _active = false;
+    wake();
+    if (_thread.joinable())
+        _thread.join();
+
+    libusb_exit(_context);
+    _context = nullptr;
+}
+
+void UsbContext::attach(UsbPoller *poller)
+{
+    std::lock_guard<std::mutex> lock(_pollersMutex);
+    _pollers.push_back(poller);
+    _streaming = _pollers.size();
+    // Event thread may be blocked with nothing to poll
+    wake();
+}
+
+void UsbContext::detach(UsbPoller *poller)
+{
+    uint32_t round;
+    {
+        std::lock_guard<std::mutex> lock(_pollersMutex);
+        _pollers.erase(std::remove(_pollers.begin(), _pollers.end(), poller), _pollers.end());
+        _streaming = _pollers.size();
+        round = _rounds.load();
+    }
+    wake();
+
+    // Round counter moves only after event handling, so a callback that may have been
+    // running when we came here is done once it changes
+    if (std::this_thread::get_id() == _thread.get_id())
+        return;
+    _roundWaiter.wait([this, round]()
+                      { return _rounds.load() != round; },
+                      _active);
+}
+
+void UsbContext::wake()
+{
+    // Returns blocked event handling, or the next one if nobody is handling events right now
+    libusb_interrupt_event_handler(_context);
+}
+
+std::string UsbContext::devicePath(libusb_device *device)
+{
+    uint8_t ports[USB_PORT_DEPTH];
+    int count = libusb_get_port_numbers(device, ports, USB_PORT_DEPTH);
+
+    std::string result = std::to_string(libusb_get_bus_number(device));
+    for (int i = 0; i < count; i++)
+        result += (i == 0 ? "-" : ".") + std::to_string(ports[i]);
+    return result;
+}
+
+void UsbContext::eventLoop()
+{
+    setThreadName("usb-events");
+    setThreadPriority(ThreadPriority::Realtime);
+
+    log_d("USB event thread started");
+
+    while (_active)
+    {
+        // Parked transfers are resumed from pollers, so step is short only while someone streams.
+        // Otherwise only hotplug may come, attach and shutdown interrupt the wait.
+        if (_streaming)
+        {
+            timeval timeout{0, USB_EVENT_TIMEOUT * 1000};
+            libusb_handle_events_timeout_completed(_context, &timeout, nullptr);
+        }
+        else
+            libusb_handle_events_completed(_context, nullptr);
+
+        {
+            std::lock_guard<std::mutex> lock(_pollersMutex);
+            for (UsbPoller *poller : _pollers)
+                poller->poll();
+            _rounds++;
+        }
+        _roundWaiter.notify();
+    }
+
+    log_v("USB event thread stopped");
+}
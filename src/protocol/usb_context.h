@@ -0,0 +1,65 @@
+#ifndef SRC_PROTOCOL_USB_CONTEXT
+#define SRC_PROTOCOL_USB_CONTEXT
+
+#include <libusb-1.0/libusb.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/adaptive_waiter.h"
+
+#define USB_EVENT_TIMEOUT 1 // ms, event handling step while devices are streaming
+
+// Called on usb event thread after every round of event handling
+class UsbPoller
+{
+public:
+    virtual ~UsbPoller() = default;
+    virtual void poll() = 0;
+};
+
+// Libusb context shared by all usb transports in the process.
+// One event thread handles transfer and hotplug callbacks for every device, so
+// several dongles do not need a reading thread each. With no poller attached it blocks
+// in libusb until a hotplug event comes or a poller is attached.
+class UsbContext
+{
+public:
+    ~UsbContext();
+
+    UsbContext(const UsbContext &) = delete;
+    UsbContext &operator=(const UsbContext &) = delete;
+
+    // Created with the first user and destroyed with the last one
+    static std::shared_ptr<UsbContext> acquire();
+
+    libusb_context *context() const { return _context; }
+
+    // Poller is not called anymore once detach returns, and a transfer or hotplug callback
+    // that was already running has finished, so the owner can be torn down afterwards
+    void attach(UsbPoller *poller);
+    void detach(UsbPoller *poller);
+
+    // Bus and port chain in sysfs form, like 1-1.4
+    static std::string devicePath(libusb_device *device);
+
+private:
+    UsbContext();
+    void eventLoop();
+    void wake();
+
+    libusb_context *_context;
+    std::thread _thread;
+    std::atomic<bool> _active;
+    std::mutex _pollersMutex;
+    std::vector<UsbPoller *> _pollers;
+    std::atomic<uint32_t> _streaming;
+    std::atomic<uint32_t> _rounds; // Finished rounds of event handling
+    AdaptiveWaiter _roundWaiter;
+};
+
+#endif /* SRC_PROTOCOL_USB_CONTEXT */
@@ -0,0 +1,109 @@
+#include "protocol/usb_tuner.h"
+
+#include <algorithm>
+
+#include "common/logger.h"
+#include "settings.h"
+
+UsbTuner::UsbTuner()
+    : _adaptive(Settings::usbAdaptive),
+      _depth(0),
+      _size(0)
+{
+    reset();
+}
+
+uint16_t UsbTuner::maxDepth()
+{
+    if (!Settings::usbAdaptive)
+        return std::max(1, Settings::usbQueue.value);
+    return std::max({USB_TUNER_MIN_CALLS, Settings::usbQueue.value, Settings::usbAdaptiveMaxCalls.value});
+}
+
+uint32_t UsbTuner::maxSize()
+{
+    if (!Settings::usbAdaptive)
+        return std::max(1, Settings::usbTransferSize.value);
+    return std::max({USB_TUNER_MIN_SIZE, Settings::usbTransferSize.value, Settings::usbAdaptiveMaxSize.value});
+}
+
+void UsbTuner::reset()
+{
+    // Configured values are the starting point of the adaptive mode
+    _depth.store(_adaptive ? std::clamp<int>(Settings::usbQueue, USB_TUNER_MIN_CALLS, maxDepth()) : maxDepth());
+    _size.store(_adaptive ? std::clamp<uint32_t>(Settings::usbTransferSize, USB_TUNER_MIN_SIZE, maxSize()) : maxSize());
+    _count = 0;
+    _full = 0;
+    _exhausted = 0;
+    _actual = 0;
+    _requested = 0;
+    _latency = 0;
+}
+
+void UsbTuner::completed(int actual, int requested, uint32_t latencyUs)
+{
+    if (!_adaptive || requested <= 0)
+        return;
+
+    _count++;
+    _actual += actual;
+    _requested += requested;
+    _latency += latencyUs;
+    if (actual >= requested)
+        _full++;
+
+    if (_count >= USB_TUNER_WINDOW)
+        adjust();
+}
+
+void UsbTuner::exhausted()
+{
+    if (!_adaptive)
+        return;
+
+    _exhausted++;
+    adjust();
+}
+
+void UsbTuner::adjust()
+{
+    uint16_t depth = _depth.load(std::memory_order_relaxed);
+    uint32_t size = _size.load(std::memory_order_relaxed);
+
+    uint32_t fill = _requested > 0 ? static_cast<uint32_t>(100 * _actual / _requested) : 0;
+    uint32_t full = _count > 0 ? 100 * _full / _count : 0;
+    uint32_t latency = _count > 0 ? static_cast<uint32_t>(_latency / _count) : 0;
+
+    if (_exhausted > 0)
+    {
+        // Processing is behind, every in flight transfer holds a slot that could buffer data
+        depth = std::max<int>(USB_TUNER_MIN_CALLS, depth - depth / 4);
+    }
+    else if (full > 50)
+    {
+        // Device has more data than we ask for, first make transfers bigger then keep more of them in flight
+        if (size < maxSize())
+            size = std::min(maxSize(), size * 2);
+        else if (latency < USB_TUNER_FAST_US)
+            depth = std::min<int>(maxDepth(), depth + USB_TUNER_MIN_CALLS);
+    }
+    else if (fill < 25 && size > USB_TUNER_MIN_SIZE)
+    {
+        // Mostly short packets, smaller transfers are enough
+        size = std::max<uint32_t>(USB_TUNER_MIN_SIZE, size / 2);
+    }
+
+    if (depth != _depth.load(std::memory_order_relaxed) || size != _size.load(std::memory_order_relaxed))
+    {
+        log_d("USB transfers %d x %d > fill %d%% full %d%% latency %dus exhausted %d", depth, size, fill, full, latency, _exhausted);
+        _depth.store(depth, std::memory_order_relaxed);
+        _size.store(size, std::memory_order_relaxed);
+    }
+
+    _count = 0;
+    _full = 0;
+    _exhausted = 0;
+    _actual = 0;
+    _requested = 0;
+    _latency = 0;
+}
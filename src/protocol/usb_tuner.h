@@ -0,0 +1,45 @@
+#ifndef SRC_PROTOCOL_USB_TUNER
+#define SRC_PROTOCOL_USB_TUNER
+
+#include <atomic>
+#include <cstdint>
+
+#define USB_TUNER_MIN_CALLS 4
+#define USB_TUNER_MIN_SIZE 512
+#define USB_TUNER_WINDOW 256
+#define USB_TUNER_FAST_US 2000
+
+// Picks number of in flight usb reads and their size from completed transfer statistics.
+// Without usb-adaptive setting it just reports configured values.
+// All calls except depth() and size() are made from usb reading thread only.
+class UsbTuner
+{
+public:
+    UsbTuner();
+
+    void reset();
+    void completed(int actual, int requested, uint32_t latencyUs);
+    void exhausted();
+
+    uint16_t depth() const { return _depth.load(std::memory_order_relaxed); }
+    uint32_t size() const { return _size.load(std::memory_order_relaxed); }
+
+    static uint16_t maxDepth();
+    static uint32_t maxSize();
+
+private:
+    void adjust();
+
+    bool _adaptive;
+    std::atomic<uint16_t> _depth;
+    std::atomic<uint32_t> _size;
+
+    uint32_t _count;
+    uint32_t _full;
+    uint32_t _exhausted;
+    uint64_t _actual;
+    uint64_t _requested;
+    uint64_t _latency;
+};
+
+#endif /* SRC_PROTOCOL_USB_TUNER */
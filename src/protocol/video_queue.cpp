@@ -0,0 +1,249 @@
+#include "protocol/video_queue.h"
+
+#include "common/logger.h"
+
+#define NAL_SLICE 1
+#define NAL_IDR 5
+#define NAL_SPS 7
+#define NAL_PPS 8
+
+VideoQueue::VideoQueue(uint16_t size)
+    : _size(size), _waitKeyframe(false), _requestPending(false), _count(0), _dropped(0), _requests(0)
+{
+}
+
+// Annex-B, NAL header follows 00 00 01. Parameter sets come before the slices,
+// so the scan stops at the first slice and never touches the picture data
+void VideoQueue::scan(Scan &state, const uint8_t *data, uint32_t length)
+{
+    for (uint32_t i = 0; i < length && !state.done; i++)
+    {
+        uint8_t byte = data[i];
+        if (!state.header)
+        {
+            if (byte == 1 && state.zeros >= 2)
+                state.header = true;
+            state.zeros = byte == 0 ? (state.zeros < 2 ? state.zeros + 1 : 2) : 0;
+            continue;
+        }
+
+        state.header = false;
+        state.zeros = 0;
+        uint8_t type = byte & 0x1f;
+        if (type == NAL_SPS || type == NAL_PPS)
+        {
+            state.flags |= VIDEO_FRAME_CONFIG;
+            continue;
+        }
+        if (type != NAL_SLICE && type != NAL_IDR)
+            continue;
+
+        state.flags |= VIDEO_FRAME_SLICE;
+        if (type == NAL_IDR)
+            state.flags |= VIDEO_FRAME_KEY;
+        if (byte & 0x60)
+            state.flags |= VIDEO_FRAME_REFERENCE;
+        state.done = true;
+    }
+}
+
+uint8_t VideoQueue::classify(const uint8_t *data, int32_t length)
+{
+    Scan state;
+    if (data && length > 0)
+        scan(state, data, length);
+    return state.flags;
+}
+
+uint8_t VideoQueue::classify(const Message &message)
+{
+    Scan state;
+    message.visit([&](const uint8_t *data, uint32_t length)
+                  {
+        scan(state, data, length);
+        return !state.done; });
+    return state.flags;
+}
+
+bool VideoQueue::push(std::unique_ptr<Message> message)
+{
+    if (!message)
+        return false;
+
+    // Sliced payload stays in the usb slots, decoder joins it when it takes the packet
+    uint8_t flags = classify(*message);
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+
+        if (_waitKeyframe)
+        {
+            // Frames before the IDR would decode from missing references
+            if ((flags & VIDEO_FRAME_SLICE) && !(flags & VIDEO_FRAME_KEY))
+            {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                if (std::chrono::steady_clock::now() - _requested > std::chrono::milliseconds(VIDEO_KEYFRAME_RETRY))
+                {
+                    _requestPending = true;
+                    _requested = std::chrono::steady_clock::now();
+                }
+                return false;
+            }
+            if (flags & VIDEO_FRAME_KEY)
+            {
+                log_d("Video resumed on keyframe");
+                _waitKeyframe = false;
+            }
+        }
+
+        // Evicted packets are counted in makeRoom, incoming one is queued after it
+        if (_items.size() >= _size)
+        {
+            if (!makeRoom(flags))
+            {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        _items.push_back({std::move(message), flags});
+        _count.store(_items.size(), std::memory_order_release);
+    }
+    _waiter.notify();
+    return true;
+}
+
+bool VideoQueue::makeRoom(uint8_t flags)
+{
+    // Nobody predicts from a non reference frame, incoming one goes first
+    if ((flags & VIDEO_FRAME_SLICE) && !(flags & VIDEO_FRAME_REFERENCE))
+        return false;
+
+    for (auto it = _items.begin(); it != _items.end(); ++it)
+    {
+        if ((it->flags & VIDEO_FRAME_SLICE) && !(it->flags & VIDEO_FRAME_REFERENCE))
+        {
+            _items.erase(it);
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    // New IDR makes everything queued obsolete
+    if (flags & VIDEO_FRAME_KEY)
+    {
+        _dropped.fetch_add(_items.size(), std::memory_order_relaxed);
+        _items.clear();
+        log_d("Video queue flushed > keyframe received");
+        return true;
+    }
+
+    // Not worth losing reference data for a packet without picture or parameter sets
+    if (!(flags & (VIDEO_FRAME_SLICE | VIDEO_FRAME_CONFIG)))
+        return false;
+
+    // Decoder restarts cleanly from the latest queued IDR, parameter sets are kept
+    for (size_t i = _items.size(); i-- > 1;)
+    {
+        if (!(_items[i].flags & VIDEO_FRAME_KEY))
+            continue;
+
+        uint32_t dropped = 0;
+        for (size_t j = 0; j < i; j++)
+        {
+            if (_items[j].flags & VIDEO_FRAME_SLICE)
+            {
+                _items[j].message.reset();
+                dropped++;
+            }
+        }
+        if (dropped == 0)
+            break;
+
+        std::deque<Entry> kept;
+        for (Entry &entry : _items)
+        {
+            if (entry.message)
+                kept.push_back(std::move(entry));
+        }
+        _items.swap(kept);
+        _dropped.fetch_add(dropped, std::memory_order_relaxed);
+        log_d("Video queue flushed > %u frames before keyframe", dropped);
+        return true;
+    }
+
+    skipToKeyframe();
+    return !(flags & VIDEO_FRAME_SLICE);
+}
+
+void VideoQueue::skipToKeyframe()
+{
+    // Reference data is lost either way, keep only parameter sets and wait for a fresh IDR
+    std::deque<Entry> kept;
+    for (Entry &entry : _items)
+    {
+        if (entry.flags & VIDEO_FRAME_SLICE)
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+        else
+            kept.push_back(std::move(entry));
+    }
+    _items.swap(kept);
+    _count.store(_items.size(), std::memory_order_release);
+
+    _waitKeyframe = true;
+    _requestPending = true;
+    _requested = std::chrono::steady_clock::now();
+    log_w("Video queue is full > waiting for keyframe");
+}
+
+void VideoQueue::lost()
+{
+    // Queued frames came before the loss and still decode fine
+    std::lock_guard<std::mutex> lock(_mtx);
+    _waitKeyframe = true;
+    _requestPending = true;
+    _requested = std::chrono::steady_clock::now();
+    log_w("Video data lost > waiting for keyframe");
+}
+
+std::unique_ptr<Message> VideoQueue::pop()
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    if (_items.empty())
+        return nullptr;
+
+    std::unique_ptr<Message> result = std::move(_items.front().message);
+    _items.pop_front();
+    _count.store(_items.size(), std::memory_order_release);
+    return result;
+}
+
+bool VideoQueue::wait(std::atomic<bool> &waitFlag)
+{
+    return _waiter.wait([&]()
+                        { return _count.load(std::memory_order_acquire) > 0; },
+                        waitFlag);
+}
+
+void VideoQueue::clear()
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    _items.clear();
+    _count.store(0, std::memory_order_release);
+    _waitKeyframe = false;
+    _requestPending = false;
+}
+
+void VideoQueue::notify()
+{
+    _waiter.notify();
+}
+
+bool VideoQueue::keyframeNeeded()
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    if (!_requestPending)
+        return false;
+    _requestPending = false;
+    _requests.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
@@ -0,0 +1,88 @@
+#ifndef SRC_PROTOCOL_VIDEO_QUEUE
+#define SRC_PROTOCOL_VIDEO_QUEUE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include "common/adaptive_waiter.h"
+#include "protocol/message.h"
+
+#define VIDEO_KEYFRAME_RETRY 1000 // Repeat keyframe request if it did not come in time, ms
+
+// What a video packet carries, taken from H.264 NAL headers
+#define VIDEO_FRAME_KEY 0x01       // IDR slice, decoding can restart here
+#define VIDEO_FRAME_REFERENCE 0x02 // Slice other frames are predicted from
+#define VIDEO_FRAME_CONFIG 0x04    // SPS / PPS
+#define VIDEO_FRAME_SLICE 0x08     // Any picture data
+
+// Video packets between receiving thread and decoder. When full it drops what hurts the picture least:
+// a non reference frame first, then everything before the latest IDR. With no IDR queued reference
+// data is lost, so the stream is skipped up to the next IDR and a keyframe is requested.
+class VideoQueue
+{
+public:
+    VideoQueue(uint16_t size);
+
+    VideoQueue(const VideoQueue &) = delete;
+    VideoQueue &operator=(const VideoQueue &) = delete;
+
+    static uint8_t classify(const uint8_t *data, int32_t length);
+    // Same for a payload that may still be split across usb slots
+    static uint8_t classify(const Message &message);
+
+    // False only when the packet itself was dropped
+    bool push(std::unique_ptr<Message> message);
+    std::unique_ptr<Message> pop();
+
+    bool wait(std::atomic<bool> &waitFlag);
+    void clear();
+    void notify();
+
+    // Reference data was dropped before it reached the queue, frames wait for the next IDR
+    void lost();
+
+    // True once per needed keyframe request, the caller sends it to the phone
+    bool keyframeNeeded();
+
+    uint16_t count() const { return _count.load(std::memory_order_acquire); }
+    uint32_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+    uint32_t keyframeRequests() const { return _requests.load(std::memory_order_relaxed); }
+
+private:
+    // Start code may be split between two pieces of payload, so scan state goes from one to the next
+    struct Scan
+    {
+        uint8_t flags = 0;
+        uint8_t zeros = 0;
+        bool header = false;
+        bool done = false;
+    };
+
+    static void scan(Scan &state, const uint8_t *data, uint32_t length);
+
+    struct Entry
+    {
+        std::unique_ptr<Message> message;
+        uint8_t flags;
+    };
+
+    bool makeRoom(uint8_t flags);
+    void skipToKeyframe();
+
+    std::deque<Entry> _items;
+    uint16_t _size;
+    bool _waitKeyframe;
+    bool _requestPending;
+    std::chrono::steady_clock::time_point _requested;
+    std::mutex _mtx;
+    AdaptiveWaiter _waiter;
+    std::atomic<uint16_t> _count;
+    std::atomic<uint32_t> _dropped;
+    std::atomic<uint32_t> _requests;
+};
+
+#endif /* SRC_PROTOCOL_VIDEO_QUEUE */
@@ -0,0 +1,190 @@
+#include "protocol/write_queue.h"
+
+WriteQueue::WriteQueue()
+    : _control(WRITE_LANE_CONTROL_SIZE, &_waiter),
+      _bulk(WRITE_LANE_BULK_SIZE, &_waiter),
+      _dropped(0),
+      _coalesced(0)
+{
+}
+
+WriteLane WriteQueue::laneOf(const Message &message)
+{
+    switch (message.type())
+    {
+    case CMD_TOUCH:
+    case CMD_MULTI_TOUCH:
+    case CMD_CONTROL:
+        return WriteLane::Input;
+    case CMD_AUDIO_DATA:
+        return WriteLane::Audio;
+    case CMD_SEND_FILE:
+        return WriteLane::Bulk;
+    default:
+        return WriteLane::Control;
+    }
+}
+
+bool WriteQueue::push(std::unique_ptr<Message> message, WriteLane lane)
+{
+    if (!message)
+        return false;
+
+    if (lane == WriteLane::Audio)
+        return pushAudio(std::move(message));
+
+    if (lane != WriteLane::Input)
+    {
+        // Lane wakes the writer itself
+        if (!(lane == WriteLane::Control ? _control : _bulk).pushDiscard(std::move(message)))
+        {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // Replaced move is freed outside the lock
+    std::unique_ptr<Message> replaced;
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        replaced = coalesce(*message);
+
+        uint16_t count = _input.count.load(std::memory_order_relaxed);
+        if (count == WRITE_LANE_INPUT_SIZE)
+        {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        _input.at(count) = std::move(message);
+        _input.count.store(count + 1, std::memory_order_release);
+    }
+
+    _waiter.notify();
+    return true;
+}
+
+std::unique_ptr<Message> WriteQueue::coalesce(const Message &message)
+{
+    if (!message.isMotion())
+        return nullptr;
+
+    // Newest pending event of the same kind decides, a click in between keeps the move
+    uint16_t count = _input.count.load(std::memory_order_relaxed);
+    for (int i = count - 1; i >= 0; i--)
+    {
+        if (_input.at(i)->type() != message.type())
+            continue;
+        if (!_input.at(i)->replacedBy(message))
+            return nullptr;
+
+        // Old move leaves the lane and the new one goes to the tail, so it never overtakes input queued after the old one
+        std::unique_ptr<Message> result = std::move(_input.at(i));
+        for (uint16_t j = i; j + 1 < count; j++)
+            _input.at(j) = std::move(_input.at(j + 1));
+        _input.count.store(count - 1, std::memory_order_release);
+        _coalesced.fetch_add(1, std::memory_order_relaxed);
+        return result;
+    }
+    return nullptr;
+}
+
+bool WriteQueue::pushAudio(std::unique_ptr<Message> message)
+{
+    // Stale microphone audio is useless, newest chunk always goes in and the oldest makes room
+    std::unique_ptr<Message> stale;
+    {
+        std::lock_guard<std::mutex> lock(_audioMutex);
+        uint16_t count = _audio.count.load(std::memory_order_relaxed);
+        if (count == WRITE_LANE_AUDIO_SIZE)
+        {
+            stale = std::move(_audio.at(0));
+            _audio.first = (_audio.first + 1) % WRITE_LANE_AUDIO_SIZE;
+            count--;
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        _audio.at(count) = std::move(message);
+        _audio.count.store(count + 1, std::memory_order_release);
+    }
+
+    _waiter.notify();
+    return true;
+}
+
+template <uint16_t Size>
+std::unique_ptr<Message> WriteQueue::popLocked(LockedLane<Size> &lane, std::mutex &mutex, uint32_t maxSize)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint16_t count = lane.count.load(std::memory_order_relaxed);
+    if (count == 0 || lane.at(0)->wireSize() > maxSize)
+        return nullptr;
+
+    std::unique_ptr<Message> result = std::move(lane.at(0));
+    lane.first = (lane.first + 1) % Size;
+    lane.count.store(count - 1, std::memory_order_release);
+    return result;
+}
+
+template <uint16_t Size>
+void WriteQueue::clearLocked(LockedLane<Size> &lane, std::mutex &mutex)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::unique_ptr<Message> &item : lane.items)
+        item.reset();
+    lane.first = 0;
+    lane.count.store(0, std::memory_order_release);
+}
+
+std::unique_ptr<Message> WriteQueue::popFront(MpscQueue<Message> &lane, uint32_t maxSize)
+{
+    const Message *front = lane.peek();
+    if (!front || front->wireSize() > maxSize)
+        return nullptr;
+    return lane.pop();
+}
+
+std::unique_ptr<Message> WriteQueue::pop(uint32_t maxSize)
+{
+    // Lanes are checked without locks first, the first one with something decides
+    if (_input.count.load(std::memory_order_acquire) > 0)
+        return popLocked(_input, _mtx, maxSize);
+    if (_control.peek())
+        return popFront(_control, maxSize);
+    if (_audio.count.load(std::memory_order_acquire) > 0)
+        return popLocked(_audio, _audioMutex, maxSize);
+    return popFront(_bulk, maxSize);
+}
+
+uint16_t WriteQueue::count() const
+{
+    return _input.count.load(std::memory_order_acquire) + _control.count() + _audio.count.load(std::memory_order_acquire) + _bulk.count();
+}
+
+bool WriteQueue::wait(std::atomic<bool> &waitFlag)
+{
+    return _waiter.wait([&]()
+                        { return count() > 0; },
+                        waitFlag);
+}
+
+bool WriteQueue::waitFor(std::atomic<bool> &waitFlag, uint32_t timeoutMs)
+{
+    return _waiter.wait([&]()
+                        { return count() > 0; },
+                        waitFlag, timeoutMs);
+}
+
+void WriteQueue::clear()
+{
+    clearLocked(_input, _mtx);
+    clearLocked(_audio, _audioMutex);
+    _control.clear();
+    _bulk.clear();
+}
+
+void WriteQueue::notify()
+{
+    _waiter.notify();
+}
@@ -0,0 +1,95 @@
+#ifndef SRC_PROTOCOL_WRITE_QUEUE
+#define SRC_PROTOCOL_WRITE_QUEUE
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "common/adaptive_waiter.h"
+#include "protocol/message.h"
+#include "struct/mpsc_queue.h"
+
+#define WRITE_LANE_INPUT_SIZE 64
+#define WRITE_LANE_CONTROL_SIZE 64
+#define WRITE_LANE_AUDIO_SIZE 4 // 2560 bytes of microphone audio is 80ms, oldest chunk goes when full
+#define WRITE_LANE_BULK_SIZE 32
+
+// Lanes in the order they are written to the dongle
+enum class WriteLane : uint8_t
+{
+    Input,
+    Control,
+    Audio,
+    Bulk
+};
+
+// Outgoing messages split by class, so touches and keys never wait behind audio or files.
+// Touch moves replace pending moves of the same pointers and take their place at the back of the lane,
+// other messages keep their order within a lane.
+// Input and audio lanes take a short lock for that and for dropping the oldest audio chunk when full,
+// control and bulk lanes are lock free. Other full lanes reject new messages.
+// Pop, clear and waits are for the single writing thread.
+class WriteQueue
+{
+public:
+    WriteQueue();
+
+    WriteQueue(const WriteQueue &) = delete;
+    WriteQueue &operator=(const WriteQueue &) = delete;
+
+    static WriteLane laneOf(const Message &message);
+
+    bool push(std::unique_ptr<Message> message)
+    {
+        if (!message)
+            return false;
+        WriteLane lane = laneOf(*message);
+        return push(std::move(message), lane);
+    }
+
+    bool push(std::unique_ptr<Message> message, WriteLane lane);
+
+    // Front message of the highest priority lane, only when it takes no more than maxSize bytes on the wire
+    std::unique_ptr<Message> pop(uint32_t maxSize = UINT32_MAX);
+
+    bool wait(std::atomic<bool> &waitFlag);
+    bool waitFor(std::atomic<bool> &waitFlag, uint32_t timeoutMs);
+    void clear();
+    void notify();
+
+    uint16_t count() const;
+    uint32_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+    uint32_t coalesced() const { return _coalesced.load(std::memory_order_relaxed); }
+
+private:
+    template <uint16_t Size>
+    struct LockedLane
+    {
+        std::unique_ptr<Message> items[Size];
+        uint16_t first = 0;
+        std::atomic<uint16_t> count{0};
+
+        std::unique_ptr<Message> &at(uint16_t index) { return items[(first + index) % Size]; }
+    };
+
+    template <uint16_t Size>
+    static std::unique_ptr<Message> popLocked(LockedLane<Size> &lane, std::mutex &mutex, uint32_t maxSize);
+    template <uint16_t Size>
+    static void clearLocked(LockedLane<Size> &lane, std::mutex &mutex);
+    static std::unique_ptr<Message> popFront(MpscQueue<Message> &lane, uint32_t maxSize);
+    bool pushAudio(std::unique_ptr<Message> message);
+    std::unique_ptr<Message> coalesce(const Message &message);
+
+    LockedLane<WRITE_LANE_INPUT_SIZE> _input;
+    LockedLane<WRITE_LANE_AUDIO_SIZE> _audio;
+    AdaptiveWaiter _waiter;
+    MpscQueue<Message> _control;
+    MpscQueue<Message> _bulk;
+    std::mutex _mtx;
+    std::mutex _audioMutex;
+    std::atomic<uint32_t> _dropped;
+    std::atomic<uint32_t> _coalesced;
+};
+
+#endif /* SRC_PROTOCOL_WRITE_QUEUE */
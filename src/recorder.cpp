@@ -1,26 +1,62 @@
 #include "recorder.h"
 
+#include <algorithm>
 #include <iostream>
 #include <cstring>
 
-#include "protocol/protocol_const.h"
+#include "common/logger.h"
+#include "common/threading.h"
 
 Recorder::Recorder()
-    : _queue(nullptr), _active(false), _device(0)
+    : _selected(nullptr), _target(nullptr), _active(false), _device(0), _free(RECORDER_CHUNKS), _filled(RECORDER_CHUNKS), _dropped(0)
 {
+    for (int i = 0; i < RECORDER_CHUNKS; i++)
+        _free.pushDiscard(std::make_unique<Chunk>());
 }
 
 Recorder::~Recorder()
 {
-    stop();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _wanted.clear();
+    close();
 }
 
-void Recorder::start(AtomicQueue<Message> *queue)
+void Recorder::start(WriteQueue *queue)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (std::find(_wanted.begin(), _wanted.end(), queue) == _wanted.end())
+        _wanted.push_back(queue);
+    route();
+    open();
+}
+
+void Recorder::stop(WriteQueue *queue)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _wanted.erase(std::remove(_wanted.begin(), _wanted.end(), queue), _wanted.end());
+    route();
+    if (_wanted.empty())
+        close();
+}
+
+void Recorder::select(WriteQueue *queue)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _selected = queue;
+    route();
+}
+
+void Recorder::route()
+{
+    bool wanted = std::find(_wanted.begin(), _wanted.end(), _selected) != _wanted.end();
+    _target = wanted ? _selected : nullptr;
+}
+
+void Recorder::open()
 {
     if (_active)
         return;
 
-    _queue = queue;
     _active = true;
 
     SDL_AudioSpec spec;
@@ -41,27 +77,63 @@ void Recorder::start(AtomicQueue<Message> *queue)
         return;
     }
 
+    _thread = std::thread(&Recorder::loop, this);
     SDL_PauseAudioDevice(_device, 0);
 }
 
-void Recorder::stop()
+void Recorder::close()
 {
     if (!_active)
         return;
     _active = false;
 
+    // Callback is not running anymore once the device is closed, all chunks are in one of the rings
     SDL_PauseAudioDevice(_device, 1);
     SDL_CloseAudioDevice(_device);
+    _filled.notify();
+    if (_thread.joinable())
+        _thread.join();
+    while (std::unique_ptr<Chunk> chunk = _filled.pop())
+        _free.pushDiscard(std::move(chunk));
+
+    uint32_t dropped = _dropped.exchange(0);
+    if (dropped > 0)
+        log_w("Microphone chunks dropped > %u", dropped);
+}
+
+void Recorder::loop()
+{
+    setThreadName("recorder");
+    while (_filled.wait(_active))
+    {
+        std::unique_ptr<Chunk> chunk = _filled.pop();
+        if (!chunk)
+            continue;
+
+        // Background sessions don't hear the microphone, their chunks are just recycled
+        WriteQueue *queue = _target.load();
+        std::unique_ptr<Message> message = queue ? Message::Audio(chunk->length) : nullptr;
+        if (message && message->allocated())
+        {
+            std::memcpy(message->data(), chunk->data, chunk->length);
+            queue->push(std::move(message));
+        }
+        _free.pushDiscard(std::move(chunk));
+    }
 }
 
 void Recorder::AudioCallback(void *userdata, Uint8 *stream, int len)
 {
     Recorder *self = static_cast<Recorder *>(userdata);
-    if (!self->_queue)
-        return;
-    std::unique_ptr<Message> message = Message::Audio(len);
-    if(!message->allocated())
+    // Both rings hold every chunk, so pushing back never fails and nothing is freed here
+    std::unique_ptr<Chunk> chunk = self->_free.pop();
+    if (!chunk)
+    {
+        self->_dropped.fetch_add(1, std::memory_order_relaxed);
         return;
-    std::memcpy(message->data(), stream, len);
-    self->_queue->pushDiscard(std::move(message));
+    }
+
+    chunk->length = std::min<uint32_t>(len, AUDIO_BUFFER_SIZE);
+    std::memcpy(chunk->data, stream, chunk->length);
+    self->_filled.pushDiscard(std::move(chunk));
 }
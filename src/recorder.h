@@ -2,27 +2,58 @@
 #define SRC_RECORDER
 
 #include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <SDL2/SDL.h>
 
-#include "struct/atomic_queue.h"
 #include "protocol/message.h"
+#include "protocol/protocol_const.h"
+#include "protocol/write_queue.h"
+#include "struct/atomic_queue.h"
+
+#define RECORDER_CHUNKS 4 // Microphone buffers circulating between audio callback and recorder thread
 
+// Audio callback only moves preallocated chunks between two lock free rings,
+// messages are made and queued on the recorder thread, so the callback never allocates or locks.
+// One microphone is shared by all sessions, it is open while any phone asks for it
+// and its audio goes only to the selected session.
 class Recorder
 {
 public:
     Recorder();
     ~Recorder();
 
-    void start(AtomicQueue<Message> *queue);
-    void stop();
+    // Phone behind this queue wants or no longer wants microphone audio
+    void start(WriteQueue *queue);
+    void stop(WriteQueue *queue);
+    // Session that is shown gets the audio
+    void select(WriteQueue *queue);
 
 private:
-    static void AudioCallback(void *userdata, Uint8 *stream, int len);
+    struct Chunk
+    {
+        uint8_t data[AUDIO_BUFFER_SIZE];
+        uint32_t length = 0;
+    };
 
-    AtomicQueue<Message> *_queue;
+    static void AudioCallback(void *userdata, Uint8 *stream, int len);
+    void open();
+    void close();
+    void route();
+    void loop();
+
+    std::mutex _mutex;
+    std::vector<WriteQueue *> _wanted;
+    WriteQueue *_selected;
+    std::atomic<WriteQueue *> _target; // Selected queue while its phone wants audio
     std::atomic<bool> _active;
     SDL_AudioDeviceID _device;
+    std::thread _thread;
+    AtomicQueue<Chunk> _free;
+    AtomicQueue<Chunk> _filled;
+    std::atomic<uint32_t> _dropped; // Callback had no free chunk
 };
 
 #endif /* SRC_RECORDER */
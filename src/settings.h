@@ -7,6 +7,8 @@
 #define SCREEN_MODE_FULLSCREEN 1
 #define SCREEN_MODE_HEADLESS 2
 
+#define KEY_NEXT_SESSION 1000 // Handled by application, never sent to the dongle
+
 // The singleton “Settings” namespace
 class Settings
 {
@@ -23,6 +25,7 @@ public:
 
     // Device configurations section
     static inline Setting<bool> encryption{"encryption", false};
+    static inline Setting<bool> decryptThread{"decrypt-thread", true};
     static inline Setting<bool> autoconnect{"autoconnect", true};
     static inline Setting<bool> weakCharge{"weak-charge", true};
     static inline Setting<bool> leftDrive{"left-hand-drive", true};
@@ -38,6 +41,10 @@ public:
     static inline Setting<int> fontSize{"font-size", 40};
     static inline Setting<bool> vsync{"vsync", false};
     static inline Setting<bool> hwDecode{"hw-decode", true};
+    static inline Setting<int> catchupHigh{"decode-catchup", 100};
+    static inline Setting<int> catchupLow{"decode-catchup-low", 20};
+    static inline Setting<int> decodeThreading{"decode-threading", 1};
+    static inline Setting<int> decodeThreads{"decode-threads", 0};
     static inline Setting<int> renderingBuffer{"rendering-buffer", 5};
     static inline Setting<int> eventsSkip{"draw-skip-events", 3};
     static inline Setting<int> forceRedraw{"force-redraw", 0};
@@ -47,7 +54,21 @@ public:
     static inline Setting<bool> fastScale{"fast-render-scale", false};
     static inline Setting<int> usbQueue{"async-usb-calls", 32};
     static inline Setting<int> usbTransferSize{"usb-buffer-size", 2048};  
-    static inline Setting<int> usbBuffer{"usb-buffer", 128};    
+    static inline Setting<int> usbBuffer{"usb-buffer", 128};
+    static inline Setting<bool> usbZeroCopy{"usb-zero-copy", false};
+    static inline Setting<bool> usbAdaptive{"usb-adaptive", false};
+    static inline Setting<int> usbAdaptiveMaxCalls{"usb-adaptive-max-calls", 64};
+    static inline Setting<int> usbAdaptiveMaxSize{"usb-adaptive-max-size", 16384};
+    static inline Setting<int> usbWriteWindow{"usb-write-window", 4};
+    static inline Setting<int> usbWriteBatch{"usb-write-batch", 4096};
+    static inline Setting<bool> usbHotplug{"usb-hotplug", true};
+    static inline Setting<bool> usbForceReset{"usb-force-reset", false};
+    static inline Setting<std::string> usbDevices{"usb-devices", ""};
+    static inline Setting<std::string> transport{"transport", "usb"};
+    static inline Setting<std::string> transportFile{"transport-file", ""};
+    static inline Setting<bool> replayRealtime{"replay-realtime", true};
+    static inline Setting<std::string> usbCaptureFile{"usb-capture-file", ""};
+    static inline Setting<int> usbCaptureBuffer{"usb-capture-buffer", 8};
     static inline Setting<int> audioDelay{"audio-buffer-wait", 2};
     static inline Setting<int> audioDelayCall{"audio-buffer-wait-call", 6};
     static inline Setting<float> audioFade{"audio-fade", 0.3};
@@ -83,6 +104,7 @@ public:
     static inline KeySetting<int> keyVideoRelease{"key-video-release", 98, 501};
     static inline KeySetting<int> keyNavFocus{"key-nav-focus", 110, 508};
     static inline KeySetting<int> keyNavRelease{"key-nav-release", 109, 509};
+    static inline KeySetting<int> keyNextSession{"key-next-session", 9, KEY_NEXT_SESSION};
 
     // Custom scripts
     static inline Setting<std::string> script1{"custom-script-1", ""};
@@ -101,6 +123,7 @@ public:
     // Debug section
     static inline Setting<bool> codecLowDelay{"decode-low-delay", true};
     static inline Setting<bool> codecFast{"decode-fast", true};
+    static inline Setting<bool> videoDirect{"decode-direct", true};
     static inline Setting<bool> debugOverlay{"debug-overlay", false};
 
     static bool load(const std::string &filename);
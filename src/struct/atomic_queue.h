@@ -5,11 +5,13 @@
 #include <cstdint>
 #include <atomic>
 #include <memory>
-#include <condition_variable>
-#include <mutex>
+
+#include "common/adaptive_waiter.h"
 
 using namespace std;
 
+// Single producer, single consumer ring. Consumer spins briefly and then parks,
+// producer only makes a syscall when the consumer is actually asleep.
 template <typename T>
 class AtomicQueue
 {
@@ -32,7 +34,7 @@ public:
         _first = (_first + 1) % _size;
         _data[_first] = std::move(obj);
         _count.fetch_add(1, std::memory_order_release);
-        _lock.notify_one();
+        _waiter.notify();
         return true;
     }
 
@@ -47,7 +49,7 @@ public:
         _first = (_first + 1) % _size;
         _data[_first] = std::move(obj);
         _count.fetch_add(1, std::memory_order_release);
-        _lock.notify_one();
+        _waiter.notify();
         return true;
     }
 
@@ -76,19 +78,16 @@ public:
 
     bool wait(atomic<bool> &waitFlag, uint16_t count = 0)
     {
-        unique_lock<std::mutex> lock(_mtx);
-
-        _lock.wait(lock, [&]
-                   { return _count.load(std::memory_order_acquire) > count || !waitFlag.load(std::memory_order_acquire); });
-        return waitFlag.load(std::memory_order_acquire);
+        return _waiter.wait([&]()
+                            { return _count.load(std::memory_order_acquire) > count; },
+                            waitFlag);
     }
 
     bool waitFor(atomic<bool> &waitFlag, uint32_t timeoutMs, uint16_t count = 0)
     {
-        unique_lock<std::mutex> lock(_mtx);
-        _lock.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]
-                       { return _count.load(std::memory_order_acquire) > count || !waitFlag.load(std::memory_order_acquire); });
-        return waitFlag.load(std::memory_order_acquire);
+        return _waiter.wait([&]()
+                            { return _count.load(std::memory_order_acquire) > count; },
+                            waitFlag, timeoutMs);
     }
 
     void clear()
@@ -101,7 +100,7 @@ public:
 
     void notify()
     {
-        _lock.notify_all();
+        _waiter.notify();
     }
 
     uint16_t count() const { return _count.load(std::memory_order_acquire); }
@@ -112,8 +111,7 @@ private:
     uint16_t _first;
     uint16_t _last;
     atomic<uint16_t> _count;
-    mutex _mtx;
-    condition_variable _lock;
+    AdaptiveWaiter _waiter;
 };
 
 #endif /* SRC_STRUCT_ATOMIC_QUEUE */
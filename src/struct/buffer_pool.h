@@ -0,0 +1,137 @@
+#ifndef SRC_STRUCT_BUFFER_POOL
+#define SRC_STRUCT_BUFFER_POOL
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+
+#define BUFFER_POOL_CLASSES 9
+#define BUFFER_POOL_CLASS_BYTES (2 * 1024 * 1024)
+
+// Size classed free lists for message objects and payloads.
+// Released buffers are kept up to the class limit and reused for the next request of the same class,
+// anything larger than the biggest class goes straight to malloc.
+class BufferPool
+{
+public:
+    static BufferPool &instance()
+    {
+        static BufferPool pool;
+        return pool;
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    ~BufferPool()
+    {
+        for (SizeClass &sizeClass : _classes)
+        {
+            while (sizeClass.head)
+            {
+                FreeNode *node = sizeClass.head;
+                sizeClass.head = node->next;
+                std::free(node);
+            }
+        }
+    }
+
+    // Returns buffer of at least size bytes, real buffer size is capacity(size)
+    void *acquire(uint32_t size)
+    {
+        SizeClass *sizeClass = find(size);
+        if (sizeClass)
+        {
+            std::lock_guard<std::mutex> lock(sizeClass->mutex);
+            if (sizeClass->head)
+            {
+                FreeNode *node = sizeClass->head;
+                sizeClass->head = node->next;
+                sizeClass->count--;
+                _hits.fetch_add(1, std::memory_order_relaxed);
+                return node;
+            }
+        }
+
+        _misses.fetch_add(1, std::memory_order_relaxed);
+        return std::malloc(sizeClass ? sizeClass->size : size);
+    }
+
+    // Size should be the same value that was used to acquire the buffer
+    void release(void *buffer, uint32_t size)
+    {
+        if (!buffer)
+            return;
+
+        SizeClass *sizeClass = find(size);
+        if (sizeClass)
+        {
+            std::lock_guard<std::mutex> lock(sizeClass->mutex);
+            if (sizeClass->count < sizeClass->limit)
+            {
+                FreeNode *node = static_cast<FreeNode *>(buffer);
+                node->next = sizeClass->head;
+                sizeClass->head = node;
+                sizeClass->count++;
+                return;
+            }
+        }
+
+        std::free(buffer);
+    }
+
+    uint32_t capacity(uint32_t size) const
+    {
+        for (const SizeClass &sizeClass : _classes)
+            if (size <= sizeClass.size)
+                return sizeClass.size;
+        return size;
+    }
+
+    uint64_t hits() const { return _hits.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return _misses.load(std::memory_order_relaxed); }
+
+private:
+    struct FreeNode
+    {
+        FreeNode *next;
+    };
+
+    struct SizeClass
+    {
+        uint32_t size = 0;
+        uint16_t limit = 0;
+        uint16_t count = 0;
+        FreeNode *head = nullptr;
+        std::mutex mutex;
+    };
+
+    BufferPool()
+        : _hits(0), _misses(0)
+    {
+        // 64 bytes to 4MB, the last class holds largest payload with decoder padding
+        uint32_t size = 64;
+        for (int i = 0; i < BUFFER_POOL_CLASSES; i++)
+        {
+            _classes[i].size = size;
+            uint32_t limit = BUFFER_POOL_CLASS_BYTES / size;
+            _classes[i].limit = limit > 256 ? 256 : (limit < 2 ? 2 : limit);
+            size *= 4;
+        }
+    }
+
+    SizeClass *find(uint32_t size)
+    {
+        for (SizeClass &sizeClass : _classes)
+            if (size <= sizeClass.size)
+                return &sizeClass;
+        return nullptr;
+    }
+
+    SizeClass _classes[BUFFER_POOL_CLASSES];
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+};
+
+#endif /* SRC_STRUCT_BUFFER_POOL */
@@ -0,0 +1,130 @@
+#ifndef SRC_STRUCT_MPSC_QUEUE
+#define SRC_STRUCT_MPSC_QUEUE
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "common/adaptive_waiter.h"
+
+// Bounded queue for many producers and one consumer, each cell carries a sequence number
+// telling whose turn it is. Push never takes a lock, so it is safe from realtime callbacks.
+// Peek, pop and clear must be called from the consumer thread only.
+template <typename T>
+class MpscQueue
+{
+public:
+    // Size is rounded up to the power of two, several queues can share the waiter of their consumer
+    MpscQueue(uint16_t size, AdaptiveWaiter *waiter = nullptr)
+        : _mask(capacityFor(size) - 1),
+          _cells(new Cell[_mask + 1]),
+          _enqueue(0),
+          _dequeue(0),
+          _count(0),
+          _wake(waiter ? waiter : &_waiter)
+    {
+        for (size_t i = 0; i <= _mask; i++)
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    ~MpscQueue() { clear(); }
+
+    // False when full, the object is released in this case
+    bool pushDiscard(std::unique_ptr<T> obj)
+    {
+        size_t position = _enqueue.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true)
+        {
+            cell = &_cells[position & _mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (diff == 0)
+            {
+                if (_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                position = _enqueue.load(std::memory_order_relaxed);
+        }
+
+        // Counted before publishing, so count never goes below the number of visible items
+        _count.fetch_add(1, std::memory_order_relaxed);
+        cell->data = obj.release();
+        cell->sequence.store(position + 1, std::memory_order_release);
+        _wake->notify();
+        return true;
+    }
+
+    const T *peek() const
+    {
+        const Cell &cell = _cells[_dequeue & _mask];
+        if (cell.sequence.load(std::memory_order_acquire) != _dequeue + 1)
+            return nullptr;
+        return cell.data;
+    }
+
+    std::unique_ptr<T> pop()
+    {
+        Cell &cell = _cells[_dequeue & _mask];
+        if (cell.sequence.load(std::memory_order_acquire) != _dequeue + 1)
+            return nullptr;
+
+        std::unique_ptr<T> result(cell.data);
+        cell.data = nullptr;
+        cell.sequence.store(_dequeue + _mask + 1, std::memory_order_release);
+        _dequeue++;
+        _count.fetch_sub(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    bool waitFor(std::atomic<bool> &waitFlag, uint32_t timeoutMs)
+    {
+        return _wake->wait([&]()
+                           { return peek() != nullptr; },
+                           waitFlag, timeoutMs);
+    }
+
+    void clear()
+    {
+        while (pop())
+        {
+        }
+    }
+
+    void notify() { _wake->notify(); }
+
+    uint16_t count() const { return _count.load(std::memory_order_relaxed); }
+    uint16_t capacity() const { return _mask + 1; }
+
+private:
+    struct alignas(64) Cell
+    {
+        std::atomic<size_t> sequence;
+        T *data = nullptr;
+    };
+
+    static size_t capacityFor(uint16_t size)
+    {
+        size_t result = 2;
+        while (result < size)
+            result <<= 1;
+        return result;
+    }
+
+    const size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+    alignas(64) std::atomic<size_t> _enqueue;
+    alignas(64) size_t _dequeue;
+    std::atomic<uint16_t> _count;
+    AdaptiveWaiter _waiter;
+    AdaptiveWaiter *_wake;
+};
+
+#endif /* SRC_STRUCT_MPSC_QUEUE */
@@ -13,7 +13,7 @@ extern "C"
 class VideoBuffer
 {
 public:
-    VideoBuffer(int8_t size) : _reading(-1), _writing(-1), _latest(-1), _size(size), _frames(nullptr), _ids(nullptr)
+    VideoBuffer(int8_t size) : _reading(-1), _writing(-1), _latest(-1), _dropped(0), _size(size), _frames(nullptr), _ids(nullptr)
     {
         if (size < 3)
             throw std::runtime_error("Minimum rendering buffer size is 3");
@@ -74,6 +74,7 @@ public:
             index = 0;
         if (index == _reading.load(std::memory_order_relaxed))
         {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
             return nullptr;
         }
         _writing.store(index, std::memory_order_relaxed);
@@ -89,6 +90,9 @@ public:
         _latest.store(_writing.load(std::memory_order_relaxed), std::memory_order_release);
     }
 
+    // Frames that found the buffer full because reader did not keep up
+    uint32_t dropped() const noexcept { return _dropped.load(std::memory_order_relaxed); }
+
     void reset() noexcept
     {
         _reading.store(-1, std::memory_order_relaxed);
@@ -123,6 +127,7 @@ private:
     std::atomic<int8_t> _reading;
     std::atomic<int8_t> _writing;
     std::atomic<int8_t> _latest;
+    std::atomic<uint32_t> _dropped;
     int8_t _size;
     AVFrame **_frames;
     uint32_t *_ids;